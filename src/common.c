@@ -2,11 +2,26 @@
  */
 
 #include "common.h"
+#include "curve.h"
+#include "netlink.h"
+#include "pid.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <linux/bitops.h>
 #include <linux/freezer.h>
+#include <linux/fs.h>
 #include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/moduleparam.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
@@ -14,6 +29,71 @@
 #define UPDATE_INTERVAL_DEFAULT_MS ((u64) 1000)
 #define UPDATE_INTERVAL_MIN_MS     ((u64) 500)
 
+// in fast mode, the interval must be at least this many round trips, and never
+// less than the absolute minimum
+#define UPDATE_INTERVAL_FAST_RTTS   4
+#define UPDATE_INTERVAL_FAST_MIN_MS ((u64) 50)
+
+#define CALIBRATE_SAMPLES 4
+
+#define KRAKEN_MINOR_BASE 192
+
+#define ADAPTIVE_MAX_DEFAULT_MS            ((u64) 10000)
+#define ADAPTIVE_AGGRESSIVENESS_DEFAULT    4
+#define ADAPTIVE_AGGRESSIVENESS_MAX        16
+
+#define DISPATCH_INTERVAL_DEFAULT_MS ((u64) 100)
+#define DISPATCH_INTERVAL_MIN_MS     ((u64) 20)
+
+/* The minimum update interval in ms, as currently allowed.
+ */
+static u64 kraken_update_interval_min_ms(struct usb_kraken *kraken)
+{
+	u64 rtt_us;
+	if (!kraken->fast || ktime_compare(kraken->update_rtt,
+	                                   ktime_set(0, 0)) == 0)
+		return UPDATE_INTERVAL_MIN_MS;
+	rtt_us = ktime_to_us(kraken->update_rtt);
+	return clamp(DIV_ROUND_UP_ULL(rtt_us * UPDATE_INTERVAL_FAST_RTTS, 1000),
+	             UPDATE_INTERVAL_FAST_MIN_MS, UPDATE_INTERVAL_MIN_MS);
+}
+
+/* Raise the update interval and the intervals it depends on to the current
+ * minimum, if below it.
+ */
+static void kraken_update_interval_raise(struct usb_kraken *kraken)
+{
+	const u64 min_ms = kraken_update_interval_min_ms(kraken);
+	const ktime_t min = ms_to_ktime(min_ms);
+	unsigned long flags;
+
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) != 0 &&
+	    ktime_compare(kraken->update_interval, min) < 0)
+		kraken->update_interval = min;
+	if (ktime_compare(kraken->update_interval_set, min) < 0)
+		kraken->update_interval_set = min;
+	kraken->adaptive_min_ms = max(kraken->adaptive_min_ms, min_ms);
+	kraken->adaptive_max_ms = max(kraken->adaptive_max_ms, min_ms);
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+}
+
+/* The slack to allow the update timer for the given interval, in ns.
+ */
+static u64 kraken_update_timer_slack(struct usb_kraken *kraken,
+                                     ktime_t interval)
+{
+	return ktime_to_ns(min(kraken->update_slack, ktime_divns(interval, 2)));
+}
+
+static void kraken_update_timer_start(struct usb_kraken *kraken,
+                                      ktime_t interval)
+{
+	hrtimer_start_range_ns(&kraken->update_timer, interval,
+	                       kraken_update_timer_slack(kraken, interval),
+	                       HRTIMER_MODE_REL);
+}
+
 static ssize_t update_interval_show(struct device *dev,
                                     struct device_attribute *attr, char *buf)
 {
@@ -26,7 +106,9 @@ static ssize_t
 update_interval_store(struct device *dev, struct device_attribute *attr,
                       const char *buf, size_t count)
 {
+	ktime_t interval;
 	ktime_t interval_old;
+	unsigned long flags;
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
 	u64 interval_ms;
 	int ret = kstrtoull(buf, 0, &interval_ms);
@@ -34,20 +116,26 @@ update_interval_store(struct device *dev, struct device_attribute *attr,
 		return ret;
 	// interval is 0: halt updates
 	if (interval_ms == 0) {
-		hrtimer_cancel(&kraken->update_timer);
+		spin_lock_irqsave(&kraken->update_lock, flags);
 		kraken->update_interval = ktime_set(0, 0);
+		spin_unlock_irqrestore(&kraken->update_lock, flags);
+		hrtimer_cancel(&kraken->update_timer);
 		dev_info(dev, "halting updates: interval set to 0\n");
 		return count;
 	}
 	// interval not 0: save interval in kraken
+	interval = ms_to_ktime(max(interval_ms,
+	                           kraken_update_interval_min_ms(kraken)));
+	spin_lock_irqsave(&kraken->update_lock, flags);
 	interval_old = kraken->update_interval;
-	kraken->update_interval = ms_to_ktime(
-		max(interval_ms, UPDATE_INTERVAL_MIN_MS));
+	kraken->update_interval = interval;
+	kraken->update_interval_set = interval;
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
 	// and restart updates if they'd been halted
-	if (ktime_compare(interval_old, ktime_set(0, 0)) == 0)
+	if (ktime_compare(interval_old, ktime_set(0, 0)) == 0) {
 		dev_info(dev, "restarting updates: interval set to non-0\n");
-		hrtimer_start(&kraken->update_timer, kraken->update_interval,
-		              HRTIMER_MODE_REL);
+		kraken_update_timer_start(kraken, interval);
+	}
 	return count;
 }
 
@@ -58,36 +146,634 @@ static DEVICE_ATTR_RW(update_interval);
 static ulong update_interval_initial = UPDATE_INTERVAL_DEFAULT_MS;
 module_param_named(update_interval, update_interval_initial, ulong, 0);
 
+static ssize_t update_slack_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s64 slack_ms = ktime_to_ms(kraken->update_slack);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", slack_ms);
+}
+
+static ssize_t update_slack_store(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long flags;
+	u64 slack_ms;
+	int ret = kstrtoull(buf, 0, &slack_ms);
+	if (ret)
+		return ret;
+	// takes effect from the next timer tick
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	kraken->update_slack = ms_to_ktime(slack_ms);
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_slack);
+
+/* Whether to enable autosuspend at probe, settable as a parameter; off by
+ * default, leaving the policy to userspace.
+ */
+static bool autosuspend;
+module_param(autosuspend, bool, 0);
+
+/* Initial value of attribute `update_slack`, settable as a parameter.
+ */
+static ulong update_slack_initial;
+module_param_named(update_slack, update_slack_initial, ulong, 0);
+
+static ssize_t update_wakeups_forced_show(struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+	                 atomic_long_read(&kraken->update_wakeups_forced));
+}
+
+static DEVICE_ATTR_RO(update_wakeups_forced);
+
+static ssize_t update_wakeups_coalesced_show(struct device *dev,
+                                             struct device_attribute *attr,
+                                             char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+	                 atomic_long_read(&kraken->update_wakeups_coalesced));
+}
+
+static DEVICE_ATTR_RO(update_wakeups_coalesced);
+
+static ssize_t update_rtt_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s64 rtt_us = ktime_to_us(kraken->update_rtt);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", rtt_us);
+}
+
+static DEVICE_ATTR_RO(update_rtt);
+
+static int kraken_calibrate(struct usb_kraken *kraken);
+
+static ssize_t update_calibrate_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	bool calibrate;
+	int ret = kstrtobool(buf, &calibrate);
+	if (ret)
+		return ret;
+	if (!calibrate)
+		return count;
+	ret = kraken_calibrate(kraken);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_WO(update_calibrate);
+
+static ssize_t update_fast_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%d\n", kraken->fast);
+}
+
+static ssize_t update_fast_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	bool fast;
+	int ret = kstrtobool(buf, &fast);
+	if (ret)
+		return ret;
+	kraken->fast = fast;
+	// leaving fast mode: anything below the normal minimum is raised to it
+	if (!fast)
+		kraken_update_interval_raise(kraken);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_fast);
+
+static ssize_t update_adaptive_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%d\n", kraken->adaptive);
+}
+
+static ssize_t update_adaptive_store(struct device *dev,
+                                     struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long flags;
+	bool adaptive;
+	int ret = kstrtobool(buf, &adaptive);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	kraken->adaptive_primed = false;
+	kraken->adaptive = adaptive;
+	// no longer adapting: back to the interval set, unless halted
+	if (!adaptive &&
+	    ktime_compare(kraken->update_interval, ktime_set(0, 0)) != 0)
+		kraken->update_interval = kraken->update_interval_set;
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_adaptive);
+
+static ssize_t update_adaptive_min_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", kraken->adaptive_min_ms);
+}
+
+static ssize_t update_adaptive_min_store(struct device *dev,
+                                         struct device_attribute *attr,
+                                         const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	u64 min_ms;
+	int ret = kstrtoull(buf, 0, &min_ms);
+	if (ret)
+		return ret;
+	if (min_ms > kraken->adaptive_max_ms)
+		return -EINVAL;
+	kraken->adaptive_min_ms = max(min_ms,
+	                              kraken_update_interval_min_ms(kraken));
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_adaptive_min);
+
+static ssize_t update_adaptive_max_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", kraken->adaptive_max_ms);
+}
+
+static ssize_t update_adaptive_max_store(struct device *dev,
+                                         struct device_attribute *attr,
+                                         const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	u64 max_ms;
+	int ret = kstrtoull(buf, 0, &max_ms);
+	if (ret)
+		return ret;
+	if (max_ms < kraken->adaptive_min_ms)
+		return -EINVAL;
+	kraken->adaptive_max_ms = max_ms;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_adaptive_max);
+
+static ssize_t update_adaptive_aggressiveness_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 kraken->adaptive_aggressiveness);
+}
+
+static ssize_t update_adaptive_aggressiveness_store(
+	struct device *dev, struct device_attribute *attr, const char *buf,
+	size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int aggressiveness;
+	int ret = kstrtouint(buf, 0, &aggressiveness);
+	if (ret)
+		return ret;
+	if (aggressiveness < 1 || aggressiveness > ADAPTIVE_AGGRESSIVENESS_MAX)
+		return -EINVAL;
+	kraken->adaptive_aggressiveness = aggressiveness;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_adaptive_aggressiveness);
+
 static ssize_t update_sync_show(struct device *dev,
                                 struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	int ret;
-	kraken->update_sync_condition = false;
-	ret = !wait_event_interruptible(kraken->update_sync_waitqueue,
-	                                kraken->update_sync_condition);
+	const s64 generation = atomic64_read(&kraken->update_generation);
+	int ret = !wait_event_interruptible(
+		kraken->update_sync_waitqueue,
+		atomic64_read(&kraken->update_generation) != generation);
 	return scnprintf(buf, PAGE_SIZE, "%d\n", ret);
 }
 
 static DEVICE_ATTR_RO(update_sync);
 
+void kraken_telemetry(struct usb_kraken *kraken,
+                      struct leviathan_telemetry *telemetry)
+{
+	memset(telemetry, 0, sizeof(*telemetry));
+	telemetry->version = LEVIATHAN_TELEMETRY_VERSION;
+	telemetry->size = sizeof(*telemetry);
+	kraken_driver_telemetry(kraken, telemetry);
+}
+
+static ssize_t telemetry_read(struct file *file, struct kobject *kobj,
+                              struct bin_attribute *attr, char *buf,
+                              loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	struct leviathan_telemetry telemetry;
+
+	kraken_telemetry(kraken, &telemetry);
+	return memory_read_from_buffer(buf, count, &off, &telemetry,
+	                               sizeof(telemetry));
+}
+
+static BIN_ATTR_RO(telemetry, sizeof(struct leviathan_telemetry));
+
+static ssize_t dispatch_immediate_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%d\n", kraken->dispatch_immediate);
+}
+
+static ssize_t dispatch_immediate_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	bool immediate;
+	int ret = kstrtobool(buf, &immediate);
+	if (ret)
+		return ret;
+	kraken->dispatch_immediate = immediate;
+	return count;
+}
+
+static DEVICE_ATTR_RW(dispatch_immediate);
+
+/* Initial value of attribute `dispatch_immediate`, settable as a parameter.
+ */
+static bool dispatch_immediate_initial;
+module_param_named(dispatch_immediate, dispatch_immediate_initial, bool, 0);
+
+static ssize_t dispatch_interval_show(struct device *dev,
+                                      struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s64 interval_ms = ktime_to_ms(kraken->dispatch_interval);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", interval_ms);
+}
+
+static ssize_t dispatch_interval_store(struct device *dev,
+                                       struct device_attribute *attr,
+                                       const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	u64 interval_ms;
+	int ret = kstrtoull(buf, 0, &interval_ms);
+	if (ret)
+		return ret;
+	kraken->dispatch_interval = ms_to_ktime(
+		max(interval_ms, DISPATCH_INTERVAL_MIN_MS));
+	return count;
+}
+
+static DEVICE_ATTR_RW(dispatch_interval);
+
+static ssize_t writes_received_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+	                 atomic_long_read(&kraken->commands_written));
+}
+
+static DEVICE_ATTR_RO(writes_received);
+
+static ssize_t frames_sent_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+	                 atomic_long_read(&kraken->command_frames_sent));
+}
+
+static DEVICE_ATTR_RO(frames_sent);
+
+static ssize_t readings_stats_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return kraken_windows_show(&kraken->windows, buf);
+}
+
+static DEVICE_ATTR_RO(readings_stats);
+
+static ssize_t attr_curve_show(struct usb_kraken *kraken,
+                               enum kraken_percent which, char *buf)
+{
+	ssize_t ret;
+	mutex_lock(&kraken->control_lock);
+	ret = kraken_curve_show(&kraken->curves[which], buf);
+	mutex_unlock(&kraken->control_lock);
+	return ret;
+}
+
+static ssize_t attr_curve_store(struct usb_kraken *kraken,
+                                enum kraken_percent which, const char *buf,
+                                size_t count)
+{
+	struct kraken_curve curve;
+	int ret = kraken_curve_parse(&curve, buf);
+	if (ret) {
+		dev_warn(&kraken->interface->dev, "invalid curve: %s\n", buf);
+		return ret;
+	}
+	mutex_lock(&kraken->control_lock);
+	kraken->curves[which] = curve;
+	// the curve takes over from any PID controller
+	if (curve.points > 0)
+		kraken->pids[which].config.on = false;
+	mutex_unlock(&kraken->control_lock);
+	return count;
+}
+
+static ssize_t fan_curve_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_curve_show(kraken, KRAKEN_PERCENT_FAN, buf);
+}
+
+static ssize_t fan_curve_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_curve_store(kraken, KRAKEN_PERCENT_FAN, buf, count);
+}
+
+static DEVICE_ATTR_RW(fan_curve);
+
+static ssize_t pump_curve_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_curve_show(kraken, KRAKEN_PERCENT_PUMP, buf);
+}
+
+static ssize_t pump_curve_store(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_curve_store(kraken, KRAKEN_PERCENT_PUMP, buf, count);
+}
+
+static DEVICE_ATTR_RW(pump_curve);
+
+static ssize_t attr_pid_show(struct usb_kraken *kraken,
+                             enum kraken_percent which, char *buf)
+{
+	ssize_t ret;
+	mutex_lock(&kraken->control_lock);
+	ret = kraken_pid_show(&kraken->pids[which], buf);
+	mutex_unlock(&kraken->control_lock);
+	return ret;
+}
+
+static ssize_t attr_pid_store(struct usb_kraken *kraken,
+                              enum kraken_percent which, const char *buf,
+                              size_t count)
+{
+	struct kraken_pid_config config;
+	int ret = kraken_pid_parse(&config, buf);
+	if (ret) {
+		dev_warn(&kraken->interface->dev, "invalid PID: %s\n", buf);
+		return ret;
+	}
+	mutex_lock(&kraken->control_lock);
+	kraken_pid_set(&kraken->pids[which], &config);
+	// the PID controller takes over from any curve
+	if (config.on)
+		kraken->curves[which].points = 0;
+	mutex_unlock(&kraken->control_lock);
+	return count;
+}
+
+static ssize_t attr_pid_terms_show(struct usb_kraken *kraken,
+                                   enum kraken_percent which, char *buf)
+{
+	ssize_t ret;
+	mutex_lock(&kraken->control_lock);
+	ret = kraken_pid_show_terms(&kraken->pids[which], buf);
+	mutex_unlock(&kraken->control_lock);
+	return ret;
+}
+
+static ssize_t fan_pid_show(struct device *dev,
+                            struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_show(kraken, KRAKEN_PERCENT_FAN, buf);
+}
+
+static ssize_t fan_pid_store(struct device *dev,
+                             struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_store(kraken, KRAKEN_PERCENT_FAN, buf, count);
+}
+
+static DEVICE_ATTR_RW(fan_pid);
+
+static ssize_t fan_pid_terms_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_terms_show(kraken, KRAKEN_PERCENT_FAN, buf);
+}
+
+static DEVICE_ATTR_RO(fan_pid_terms);
+
+static ssize_t pump_pid_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_show(kraken, KRAKEN_PERCENT_PUMP, buf);
+}
+
+static ssize_t pump_pid_store(struct device *dev,
+                              struct device_attribute *attr,
+                              const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_store(kraken, KRAKEN_PERCENT_PUMP, buf, count);
+}
+
+static DEVICE_ATTR_RW(pump_pid);
+
+static ssize_t pump_pid_terms_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_pid_terms_show(kraken, KRAKEN_PERCENT_PUMP, buf);
+}
+
+static DEVICE_ATTR_RO(pump_pid_terms);
+
+/* Lengths in s of the windows of attribute `readings_stats`, settable as a
+ * parameter.
+ */
+static uint readings_windows[KRAKEN_WINDOWS_MAX] = { 10, 60, 900 };
+static int readings_windows_nr = 3;
+module_param_array(readings_windows, uint, &readings_windows_nr, 0);
+
 static int kraken_create_device_files(struct usb_interface *interface)
 {
 	int retval;
 	if ((retval = device_create_file(&interface->dev,
 	                                 &dev_attr_update_interval)))
 		goto error_update_interval;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_slack)))
+		goto error_update_slack;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_wakeups_forced)))
+		goto error_update_wakeups_forced;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_wakeups_coalesced)))
+		goto error_update_wakeups_coalesced;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_rtt)))
+		goto error_update_rtt;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_calibrate)))
+		goto error_update_calibrate;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_fast)))
+		goto error_update_fast;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_adaptive)))
+		goto error_update_adaptive;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_adaptive_min)))
+		goto error_update_adaptive_min;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_update_adaptive_max)))
+		goto error_update_adaptive_max;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_adaptive_aggressiveness)))
+		goto error_update_adaptive_aggressiveness;
 	if ((retval = device_create_file(&interface->dev,
 	                                 &dev_attr_update_sync)))
 		goto error_update_sync;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_dispatch_immediate)))
+		goto error_dispatch_immediate;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_dispatch_interval)))
+		goto error_dispatch_interval;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_writes_received)))
+		goto error_writes_received;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_frames_sent)))
+		goto error_frames_sent;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_readings_stats)))
+		goto error_readings_stats;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_fan_curve)))
+		goto error_fan_curve;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_pump_curve)))
+		goto error_pump_curve;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_fan_pid)))
+		goto error_fan_pid;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_fan_pid_terms)))
+		goto error_fan_pid_terms;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_pump_pid)))
+		goto error_pump_pid;
+	if ((retval = device_create_file(&interface->dev,
+	                                 &dev_attr_pump_pid_terms)))
+		goto error_pump_pid_terms;
+	if ((retval = device_create_bin_file(&interface->dev,
+	                                     &bin_attr_telemetry)))
+		goto error_telemetry;
 	if ((retval = kraken_driver_create_device_files(interface)))
 		goto error_driver_files;
 
 	return 0;
 error_driver_files:
+	device_remove_bin_file(&interface->dev, &bin_attr_telemetry);
+error_telemetry:
+	device_remove_file(&interface->dev, &dev_attr_pump_pid_terms);
+error_pump_pid_terms:
+	device_remove_file(&interface->dev, &dev_attr_pump_pid);
+error_pump_pid:
+	device_remove_file(&interface->dev, &dev_attr_fan_pid_terms);
+error_fan_pid_terms:
+	device_remove_file(&interface->dev, &dev_attr_fan_pid);
+error_fan_pid:
+	device_remove_file(&interface->dev, &dev_attr_pump_curve);
+error_pump_curve:
+	device_remove_file(&interface->dev, &dev_attr_fan_curve);
+error_fan_curve:
+	device_remove_file(&interface->dev, &dev_attr_readings_stats);
+error_readings_stats:
+	device_remove_file(&interface->dev, &dev_attr_frames_sent);
+error_frames_sent:
+	device_remove_file(&interface->dev, &dev_attr_writes_received);
+error_writes_received:
+	device_remove_file(&interface->dev, &dev_attr_dispatch_interval);
+error_dispatch_interval:
+	device_remove_file(&interface->dev, &dev_attr_dispatch_immediate);
+error_dispatch_immediate:
 	device_remove_file(&interface->dev, &dev_attr_update_sync);
 error_update_sync:
-	device_remove_file(&interface->dev, &dev_attr_update_sync);
+	device_remove_file(&interface->dev,
+	                   &dev_attr_update_adaptive_aggressiveness);
+error_update_adaptive_aggressiveness:
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive_max);
+error_update_adaptive_max:
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive_min);
+error_update_adaptive_min:
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive);
+error_update_adaptive:
+	device_remove_file(&interface->dev, &dev_attr_update_fast);
+error_update_fast:
+	device_remove_file(&interface->dev, &dev_attr_update_calibrate);
+error_update_calibrate:
+	device_remove_file(&interface->dev, &dev_attr_update_rtt);
+error_update_rtt:
+	device_remove_file(&interface->dev, &dev_attr_update_wakeups_coalesced);
+error_update_wakeups_coalesced:
+	device_remove_file(&interface->dev, &dev_attr_update_wakeups_forced);
+error_update_wakeups_forced:
+	device_remove_file(&interface->dev, &dev_attr_update_slack);
+error_update_slack:
+	device_remove_file(&interface->dev, &dev_attr_update_interval);
 error_update_interval:
 	return retval;
 }
@@ -96,7 +782,30 @@ static void kraken_remove_device_files(struct usb_interface *interface)
 {
 	kraken_driver_remove_device_files(interface);
 
+	device_remove_bin_file(&interface->dev, &bin_attr_telemetry);
+	device_remove_file(&interface->dev, &dev_attr_pump_pid_terms);
+	device_remove_file(&interface->dev, &dev_attr_pump_pid);
+	device_remove_file(&interface->dev, &dev_attr_fan_pid_terms);
+	device_remove_file(&interface->dev, &dev_attr_fan_pid);
+	device_remove_file(&interface->dev, &dev_attr_pump_curve);
+	device_remove_file(&interface->dev, &dev_attr_fan_curve);
+	device_remove_file(&interface->dev, &dev_attr_readings_stats);
+	device_remove_file(&interface->dev, &dev_attr_frames_sent);
+	device_remove_file(&interface->dev, &dev_attr_writes_received);
+	device_remove_file(&interface->dev, &dev_attr_dispatch_interval);
+	device_remove_file(&interface->dev, &dev_attr_dispatch_immediate);
 	device_remove_file(&interface->dev, &dev_attr_update_sync);
+	device_remove_file(&interface->dev,
+	                   &dev_attr_update_adaptive_aggressiveness);
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive_max);
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive_min);
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive);
+	device_remove_file(&interface->dev, &dev_attr_update_fast);
+	device_remove_file(&interface->dev, &dev_attr_update_calibrate);
+	device_remove_file(&interface->dev, &dev_attr_update_rtt);
+	device_remove_file(&interface->dev, &dev_attr_update_wakeups_coalesced);
+	device_remove_file(&interface->dev, &dev_attr_update_wakeups_forced);
+	device_remove_file(&interface->dev, &dev_attr_update_slack);
 	device_remove_file(&interface->dev, &dev_attr_update_interval);
 }
 
@@ -105,7 +814,18 @@ static enum hrtimer_restart kraken_update_timer(struct hrtimer *update_timer)
 	bool retval;
 	struct usb_kraken *kraken
 		= container_of(update_timer, struct usb_kraken, update_timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	const ktime_t now = ktime_get();
+
+	trace_leviathan_timer(kraken, now, hrtimer_get_expires(update_timer));
+	// woken before the hard expiry: some other wakeup within the slack ran
+	// the timer
+	if (ktime_compare(now, hrtimer_get_expires(update_timer)) < 0)
+		atomic_long_inc(&kraken->update_wakeups_coalesced);
+	else
+		atomic_long_inc(&kraken->update_wakeups_forced);
 
+	spin_lock(&kraken->update_lock);
 	// last update failed: halt updates
 	if (kraken->update_retval) {
 		dev_err(&kraken->udev->dev,
@@ -113,27 +833,485 @@ static enum hrtimer_restart kraken_update_timer(struct hrtimer *update_timer)
 		        kraken->update_retval);
 		kraken->update_retval = 0;
 		kraken->update_interval = ktime_set(0, 0);
-		return HRTIMER_NORESTART;
+		goto out;
 	}
+	// halted in the meantime
+	if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) == 0)
+		goto out;
 
-	// otherwise: queue new update and restart timer
+	// otherwise: queue new update and restart timer; if the work is still
+	// queued, its jitter is counted from this tick
+	kraken->update_queued = now;
 	retval = queue_work(kraken->update_workqueue, &kraken->update_work);
-	if (!retval)
+	if (!retval) {
 		dev_warn(&kraken->udev->dev, "work already on a queue\n");
-	hrtimer_forward(update_timer, ktime_get(), kraken->update_interval);
-	return HRTIMER_RESTART;
+		kraken_stats_count(kraken, KRAKEN_STAT_TICKS_SKIPPED);
+	}
+	hrtimer_forward(update_timer, now, kraken->update_interval);
+	// the slack may have changed since the timer was started
+	hrtimer_set_expires_range_ns(
+		update_timer, hrtimer_get_softexpires(update_timer),
+		kraken_update_timer_slack(kraken, kraken->update_interval));
+	restart = HRTIMER_RESTART;
+out:
+	spin_unlock(&kraken->update_lock);
+	return restart;
+}
+
+static bool kraken_rpm_changed(u16 rpm, u16 rpm_prev)
+{
+	// by more than 1/16
+	return abs((int) rpm - (int) rpm_prev) * 16 > rpm_prev;
+}
+
+static void kraken_update_adapt(struct usb_kraken *kraken)
+{
+	struct kraken_readings readings;
+	const struct kraken_readings *prev = &kraken->adaptive_readings;
+	const u64 aggressiveness = kraken->adaptive_aggressiveness;
+	u64 interval_ms = ktime_to_ms(kraken->update_interval);
+	u64 changes;
+	ktime_t interval;
+	unsigned long flags;
+
+	kraken_driver_readings(kraken, &readings);
+	// the nr of degrees the liquid has changed by, plus one for each speed
+	// which has changed noticeably
+	changes = abs((int) readings.temp_liquid - (int) prev->temp_liquid) +
+		kraken_rpm_changed(readings.fan_rpm, prev->fan_rpm) +
+		kraken_rpm_changed(readings.pump_rpm, prev->pump_rpm);
+	if (!kraken->adaptive_primed)
+		changes = 0;
+	kraken->adaptive_readings = readings;
+	kraken->adaptive_primed = true;
+
+	if (atomic_xchg(&kraken->adaptive_written, 0)) {
+		interval_ms = kraken->adaptive_min_ms;
+	} else if (changes == 0) {
+		// stable: stretch by aggressiveness/16
+		interval_ms += max(interval_ms * aggressiveness / 16, (u64) 1);
+	} else {
+		// changing: shrink in proportion to the rate of change per
+		// second (in thousandths)
+		const u64 rate = div64_u64(changes * 1000 * 1000, interval_ms);
+		interval_ms = div64_u64(interval_ms * 1000,
+		                        1000 + aggressiveness * rate);
+	}
+	interval_ms = clamp(interval_ms, kraken->adaptive_min_ms,
+	                    kraken->adaptive_max_ms);
+
+	interval = ms_to_ktime(interval_ms);
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	// unless halted in the meantime, a longer interval takes effect from
+	// the next timer tick, while a shorter one restarts the timer rather
+	// than wait out the rest of the longer one
+	if (kraken->adaptive &&
+	    ktime_compare(kraken->update_interval, ktime_set(0, 0)) != 0) {
+		if (ktime_compare(interval, kraken->update_interval) < 0 &&
+		    !kraken->update_suspended && !kraken->disconnected &&
+		    ktime_compare(hrtimer_get_remaining(&kraken->update_timer),
+		                  interval) > 0)
+			kraken_update_timer_start(kraken, interval);
+		kraken->update_interval = interval;
+	}
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+}
+
+/* Set every percent under control of its curve or PID controller, to be sent
+ * by the current update.
+ */
+static void kraken_control_update(struct usb_kraken *kraken)
+{
+	const ktime_t now = ktime_get();
+	int percents[KRAKEN_PERCENTS];
+	unsigned int which;
+
+	mutex_lock(&kraken->control_lock);
+	for (which = 0; which < KRAKEN_PERCENTS; which++) {
+		const struct kraken_curve *curve = &kraken->curves[which];
+		struct kraken_pid *pid = &kraken->pids[which];
+		u8 min, max;
+		int temp, ret;
+
+		percents[which] = -1;
+		if (curve->points == 0 && !pid->config.on)
+			continue;
+		ret = kraken_curve_temp(kraken, &temp);
+		kraken_driver_percent_bounds(kraken, which, &min, &max);
+		// a temperature gone stale could hide overheating: fail safe,
+		// at full speed until there's a fresh one
+		if (ret == -ESTALE) {
+			dev_warn_ratelimited(
+				&kraken->udev->dev,
+				"stale temperature, running at %u%%\n", max);
+			percents[which] = max;
+			continue;
+		}
+		// no temperature: the percent is left as is until there is one
+		if (ret) {
+			if (ret != -ENODATA)
+				dev_warn_ratelimited(
+					&kraken->udev->dev,
+					"failed to get temperature: %d\n",
+					ret);
+			continue;
+		}
+		if (curve->points > 0)
+			percents[which] = clamp_t(unsigned int,
+			                          kraken_curve_eval(curve, temp),
+			                          min, max);
+		else
+			percents[which] = kraken_pid_run(pid, temp, now, min,
+			                                 max);
+	}
+	mutex_unlock(&kraken->control_lock);
+
+	kraken_driver_percents_control(kraken, percents);
+}
+
+static void kraken_update(struct usb_kraken *kraken)
+{
+	kraken->update_start = ktime_get();
+	trace_leviathan_update_start(kraken);
+	// resume the device if autosuspended, and keep it awake for the update
+	kraken->update_retval = usb_autopm_get_interface(kraken->interface);
+	if (!kraken->update_retval) {
+		// whatever the curves and PID controllers set goes out with
+		// this very update
+		kraken_control_update(kraken);
+		kraken->update_retval = kraken_driver_update(kraken);
+		usb_autopm_put_interface(kraken->interface);
+	}
+	if (kraken->adaptive && !kraken->update_retval)
+		kraken_update_adapt(kraken);
+	trace_leviathan_update_end(kraken, kraken->update_retval);
+	if (kraken->update_retval)
+		kraken_stats_count(kraken, KRAKEN_STAT_UPDATES_FAILED);
+	if (!kraken->update_retval)
+		kraken_netlink_sample(kraken);
+	// tell any waiting update syncs that the update has finished, and any
+	// pollers of the telemetry
+	atomic64_inc(&kraken->update_generation);
+	wake_up_interruptible_all(&kraken->update_sync_waitqueue);
+	sysfs_notify(&kraken->interface->dev.kobj, NULL,
+	             bin_attr_telemetry.attr.name);
+}
+
+static void kraken_calibrate_work(struct work_struct *calibrate_work)
+{
+	struct usb_kraken *kraken
+		= container_of(calibrate_work, struct usb_kraken,
+		               calibrate_work);
+	ktime_t rtt = ktime_set(0, 0);
+	unsigned int i;
+	int ret = usb_autopm_get_interface(kraken->interface);
+	if (ret) {
+		kraken->calibrate_retval = ret;
+		return;
+	}
+
+	// keep the longest of several round trips, to leave room for jitter
+	for (i = 0; i < CALIBRATE_SAMPLES; i++) {
+		ktime_t sample;
+		const ktime_t start = ktime_get();
+		ret = kraken_driver_calibrate(kraken);
+		if (ret) {
+			dev_err(&kraken->udev->dev,
+			        "failed to calibrate: %d\n", ret);
+			kraken->calibrate_retval = ret;
+			goto out;
+		}
+		sample = ktime_sub(ktime_get(), start);
+		if (ktime_compare(sample, rtt) > 0)
+			rtt = sample;
+	}
+	kraken->update_rtt = rtt;
+	kraken->calibrate_retval = 0;
+	dev_info(&kraken->udev->dev, "calibrated: round trip of %lld us\n",
+	         ktime_to_us(rtt));
+out:
+	usb_autopm_put_interface(kraken->interface);
+}
+
+static int kraken_calibrate(struct usb_kraken *kraken)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	if (kraken->disconnected) {
+		spin_unlock_irqrestore(&kraken->update_lock, flags);
+		return -ENODEV;
+	}
+	queue_work(kraken->update_workqueue, &kraken->calibrate_work);
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+	flush_work(&kraken->calibrate_work);
+	// a longer round trip may have raised the minimum
+	kraken_update_interval_raise(kraken);
+	return kraken->calibrate_retval;
 }
 
 static void kraken_update_work(struct work_struct *update_work)
 {
 	struct usb_kraken *kraken
 		= container_of(update_work, struct usb_kraken, update_work);
-	kraken->update_retval = kraken_driver_update(kraken);
-	// tell any waiting update syncs that the update has finished
-	kraken->update_sync_condition = true;
-	wake_up_interruptible_all(&kraken->update_sync_waitqueue);
+	kraken_stats_jitter(kraken, ktime_sub(ktime_get(),
+	                                      kraken->update_queued));
+	kraken_update(kraken);
+}
+
+static void kraken_dispatch_work(struct work_struct *dispatch_work)
+{
+	struct usb_kraken *kraken = container_of(
+		to_delayed_work(dispatch_work), struct usb_kraken,
+		dispatch_work);
+	// updates halted, e.g. by a failed update: don't dispatch either
+	if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) == 0)
+		return;
+	kraken->dispatch_last = ktime_get();
+	kraken_update(kraken);
+}
+
+static void kraken_dispatch(struct usb_kraken *kraken)
+{
+	// dispatch right away, unless the last dispatch was too recent; the
+	// workqueue is ordered, so this never runs alongside a timer update
+	const ktime_t next = ktime_add(kraken->dispatch_last,
+	                               kraken->dispatch_interval);
+	const s64 delay_ms = ktime_ms_delta(next, ktime_get());
+	unsigned long flags;
+
+	// writers racing with the disconnect mustn't reach the workqueue once
+	// it's being destroyed
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	if (!kraken->disconnected)
+		queue_delayed_work(kraken->update_workqueue,
+		                   &kraken->dispatch_work,
+		                   delay_ms > 0 ? msecs_to_jiffies(delay_ms)
+		                                : 0);
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
+}
+
+void kraken_command_write(struct usb_kraken *kraken, unsigned int command)
+{
+	kraken_commands_write(kraken, BIT(command));
+}
+
+void kraken_commands_write(struct usb_kraken *kraken, unsigned long commands)
+{
+	atomic_long_inc(&kraken->commands_written);
+	kraken_commands_resend(kraken, commands);
+	atomic_set(&kraken->adaptive_written, 1);
+	if (kraken->dispatch_immediate)
+		kraken_dispatch(kraken);
+}
+
+void kraken_commands_resend(struct usb_kraken *kraken, unsigned long commands)
+{
+	unsigned int command;
+	for_each_set_bit(command, &commands, BITS_PER_LONG)
+		set_bit(command, &kraken->commands_dirty);
+}
+
+unsigned long kraken_commands_take(struct usb_kraken *kraken)
+{
+	return xchg(&kraken->commands_dirty, 0);
+}
+
+void kraken_command_frames_sent(struct usb_kraken *kraken, unsigned int frames)
+{
+	atomic_long_add(frames, &kraken->command_frames_sent);
+}
+
+int kraken_buffers_alloc(struct usb_kraken *kraken, size_t size)
+{
+	struct kraken_buffers *buffers = &kraken->buffers;
+	buffers->buffer = usb_alloc_coherent(kraken->udev, size, GFP_KERNEL,
+	                                     &buffers->dma);
+	if (buffers->buffer == NULL)
+		return -ENOMEM;
+	buffers->size = size;
+	buffers->used = 0;
+	return 0;
+}
+
+void kraken_buffers_free(struct usb_kraken *kraken)
+{
+	struct kraken_buffers *buffers = &kraken->buffers;
+	usb_free_coherent(kraken->udev, buffers->size, buffers->buffer,
+	                  buffers->dma);
+}
+
+int kraken_urb_buffer(struct usb_kraken *kraken, struct urb *urb, size_t size)
+{
+	struct kraken_buffers *buffers = &kraken->buffers;
+	if (buffers->used + KRAKEN_BUFFER_SIZE(size) > buffers->size) {
+		dev_err(&kraken->udev->dev,
+		        "transfer buffer pool exhausted: %zu of %zu used\n",
+		        buffers->used, buffers->size);
+		return -ENOMEM;
+	}
+	urb->transfer_buffer = buffers->buffer + buffers->used;
+	urb->transfer_dma = buffers->dma + buffers->used;
+	urb->transfer_buffer_length = size;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	buffers->used += KRAKEN_BUFFER_SIZE(size);
+	return 0;
+}
+
+int kraken_urb_submit(struct usb_kraken *kraken, struct urb *urb,
+                      gfp_t mem_flags)
+{
+	int ret;
+	trace_leviathan_urb_submit(kraken, urb, kraken->update_start);
+	usb_anchor_urb(urb, &kraken->update_anchor);
+	ret = usb_submit_urb(urb, mem_flags);
+	if (ret)
+		usb_unanchor_urb(urb);
+	return ret;
+}
+
+void kraken_urb_trace_submit(struct usb_kraken *kraken, struct urb *urb,
+                             ktime_t submitted)
+{
+	trace_leviathan_urb_submit(kraken, urb, submitted);
+}
+
+void kraken_urb_complete(struct usb_kraken *kraken, struct urb *urb,
+                         enum kraken_msg msg, ktime_t submitted)
+{
+	trace_leviathan_urb_complete(kraken, urb, submitted);
+	kraken_stats_urb(kraken, msg, urb, ktime_sub(ktime_get(), submitted));
+}
+
+void kraken_urb_error(struct usb_kraken *kraken, int error)
+{
+	atomic_cmpxchg(&kraken->update_urb_error, 0, error);
+}
+
+int kraken_urbs_wait(struct usb_kraken *kraken, unsigned int timeout_ms)
+{
+	if (!usb_wait_anchor_empty_timeout(&kraken->update_anchor,
+	                                   timeout_ms)) {
+		dev_err(&kraken->udev->dev, "update timed out after %u ms\n",
+		        timeout_ms);
+		kraken_urb_error(kraken, -ETIMEDOUT);
+		kraken_stats_count(kraken, KRAKEN_STAT_TIMEOUTS);
+		usb_kill_anchored_urbs(&kraken->update_anchor);
+	}
+	return atomic_xchg(&kraken->update_urb_error, 0);
+}
+
+/* Capacity of the telemetry history ring, settable as a parameter.
+ */
+static uint ring_records = 1024;
+module_param(ring_records, uint, 0);
+
+void kraken_telemetry_push(struct usb_kraken *kraken)
+{
+	struct leviathan_telemetry telemetry;
+	kraken_telemetry(kraken, &telemetry);
+	kraken_ring_push(kraken->ring, &telemetry);
+	kraken_windows_push(&kraken->windows, &telemetry);
+}
+
+static int kraken_ring_open(struct inode *inode, struct file *file)
+{
+	struct usb_interface *interface;
+	struct usb_kraken *kraken;
+
+	// the device cannot be disconnected while being opened
+	interface = usb_find_interface(kraken_usb_driver, iminor(inode));
+	if (interface == NULL)
+		return -ENODEV;
+	kraken = usb_get_intfdata(interface);
+	if (kraken == NULL)
+		return -ENODEV;
+	// the file holds on to the ring, which outlives the device if need be
+	kraken_ring_get(kraken->ring);
+	file->private_data = kraken->ring;
+	return nonseekable_open(inode, file);
+}
+
+static int kraken_ring_release(struct inode *inode, struct file *file)
+{
+	kraken_ring_put(file->private_data);
+	return 0;
+}
+
+static int kraken_ring_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	return kraken_ring_mmap(file->private_data, vma);
 }
 
+#define LEVIATHAN_BATCH_ALL (LEVIATHAN_BATCH_FAN_PERCENT | \
+                             LEVIATHAN_BATCH_PUMP_PERCENT | \
+                             LEVIATHAN_BATCH_LED_LOGO | \
+                             LEVIATHAN_BATCH_LEDS_RING | \
+                             LEVIATHAN_BATCH_LEDS_SYNC)
+
+static bool kraken_batch_reserved_clear(const struct leviathan_batch *batch)
+{
+	return !memchr_inv(batch->reserved, 0, sizeof(batch->reserved)) &&
+	       !memchr_inv(batch->led_logo.reserved, 0,
+	                   sizeof(batch->led_logo.reserved)) &&
+	       !memchr_inv(batch->leds_ring.reserved, 0,
+	                   sizeof(batch->leds_ring.reserved)) &&
+	       !memchr_inv(batch->leds_sync.reserved, 0,
+	                   sizeof(batch->leds_sync.reserved));
+}
+
+static int kraken_batch(struct usb_kraken *kraken, void *arg)
+{
+	struct leviathan_batch *batch = arg;
+	if (batch->set) {
+		const int ret = kraken_driver_batch(kraken, batch);
+		if (ret)
+			return ret;
+	}
+	kraken_telemetry(kraken, &batch->telemetry);
+	return 0;
+}
+
+static long kraken_ring_ioctl(struct file *file, unsigned int cmd,
+                              unsigned long arg)
+{
+	void __user *user = (void __user *) arg;
+	struct leviathan_batch *batch;
+	long ret;
+
+	if (cmd != LEVIATHAN_IOC_BATCH)
+		return -ENOTTY;
+	batch = memdup_user(user, sizeof(*batch));
+	if (IS_ERR(batch))
+		return PTR_ERR(batch);
+	if (batch->size != sizeof(*batch) ||
+	    (batch->set & ~LEVIATHAN_BATCH_ALL) ||
+	    !kraken_batch_reserved_clear(batch)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (batch->set && !(file->f_mode & FMODE_WRITE)) {
+		ret = -EBADF;
+		goto out;
+	}
+
+	// the device may have been disconnected since the file was opened
+	ret = kraken_netlink_call(file->private_data, kraken_batch, batch);
+	if (ret == 0 && copy_to_user(user, batch, sizeof(*batch)))
+		ret = -EFAULT;
+out:
+	kfree(batch);
+	return ret;
+}
+
+static const struct file_operations kraken_ring_fops = {
+	.owner          = THIS_MODULE,
+	.open           = kraken_ring_open,
+	.release        = kraken_ring_release,
+	.mmap           = kraken_ring_file_mmap,
+	.unlocked_ioctl = kraken_ring_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+};
+
 int kraken_probe(struct usb_interface *interface,
                  const struct usb_device_id *id)
 {
@@ -145,47 +1323,127 @@ int kraken_probe(struct usb_interface *interface,
 	if (kraken == NULL)
 		goto error_kraken;
 	kraken->udev = usb_get_dev(udev);
+	kraken->interface = interface;
 	usb_set_intfdata(interface, kraken);
 
-	retval = kraken_driver_probe(interface, id);
-	if (retval)
-		goto error_driver_probe;
-	retval = kraken_create_device_files(interface);
-	if (retval) {
-		dev_err(&interface->dev,
-		        "failed to create device files: %d\n", retval);
-		goto error_create_files;
-	}
+	init_usb_anchor(&kraken->update_anchor);
+	atomic_set(&kraken->update_urb_error, 0);
+
+	kraken->commands_dirty = 0;
+	atomic_long_set(&kraken->commands_written, 0);
+	atomic_long_set(&kraken->command_frames_sent, 0);
 
 	init_waitqueue_head(&kraken->update_sync_waitqueue);
-	kraken->update_sync_condition = false;
+	atomic64_set(&kraken->update_generation, 0);
 
 	snprintf(workqueue_name, sizeof(workqueue_name),
 	         "%s_up", kraken_driver_name);
 	kraken->update_workqueue
 		= create_singlethread_workqueue(workqueue_name);
+	if (kraken->update_workqueue == NULL)
+		goto error_workqueue;
 	INIT_WORK(&kraken->update_work, &kraken_update_work);
+	INIT_WORK(&kraken->calibrate_work, &kraken_calibrate_work);
+	INIT_DELAYED_WORK(&kraken->dispatch_work, &kraken_dispatch_work);
+
+	kraken->dispatch_immediate = dispatch_immediate_initial;
+	kraken->dispatch_interval = ms_to_ktime(DISPATCH_INTERVAL_DEFAULT_MS);
+	kraken->dispatch_last = ktime_set(0, 0);
 
 	hrtimer_init(&kraken->update_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	kraken->update_timer.function = &kraken_update_timer;
+	kraken->update_interval = ktime_set(0, 0);
+	kraken->update_retval = 0;
+	kraken->update_start = ktime_set(0, 0);
+	kraken->update_queued = ktime_set(0, 0);
+	kraken->update_suspended = false;
+	kraken->disconnected = false;
+	spin_lock_init(&kraken->update_lock);
+	kraken->update_interval_set = ms_to_ktime(UPDATE_INTERVAL_DEFAULT_MS);
+	kraken->update_slack = ms_to_ktime(update_slack_initial);
+	atomic_long_set(&kraken->update_wakeups_forced, 0);
+	atomic_long_set(&kraken->update_wakeups_coalesced, 0);
+
+	kraken->update_rtt = ktime_set(0, 0);
+	kraken->calibrate_retval = 0;
+	kraken->fast = false;
+
+	kraken->adaptive = false;
+	kraken->adaptive_min_ms = UPDATE_INTERVAL_MIN_MS;
+	kraken->adaptive_max_ms = ADAPTIVE_MAX_DEFAULT_MS;
+	kraken->adaptive_aggressiveness = ADAPTIVE_AGGRESSIVENESS_DEFAULT;
+	kraken->adaptive_primed = false;
+	atomic_set(&kraken->adaptive_written, 0);
+
+	mutex_init(&kraken->control_lock);
+	memset(kraken->curves, 0, sizeof(kraken->curves));
+	memset(kraken->pids, 0, sizeof(kraken->pids));
+
+	kraken_windows_init(&kraken->windows, readings_windows,
+	                    readings_windows_nr);
+
+	retval = -ENOMEM;
+	kraken->ring = kraken_ring_alloc(max(ring_records, 1U));
+	if (kraken->ring == NULL)
+		goto error_ring;
+	retval = kraken_stats_add(kraken);
+	if (retval)
+		goto error_stats;
+
+	retval = kraken_driver_probe(interface, id);
+	if (retval)
+		goto error_driver_probe;
+	// not fatal: fast mode just stays at the normal minimum until
+	// recalibrated
+	kraken_calibrate(kraken);
+	retval = kraken_create_device_files(interface);
+	if (retval) {
+		dev_err(&interface->dev,
+		        "failed to create device files: %d\n", retval);
+		goto error_create_files;
+	}
+	snprintf(kraken->class_name, sizeof(kraken->class_name), "%s-%%d",
+	         kraken_driver_name);
+	memset(&kraken->class, 0, sizeof(kraken->class));
+	kraken->class.name = kraken->class_name;
+	kraken->class.fops = &kraken_ring_fops;
+	kraken->class.minor_base = KRAKEN_MINOR_BASE;
+	retval = usb_register_dev(interface, &kraken->class);
+	if (retval) {
+		dev_err(&interface->dev,
+		        "failed to register character device: %d\n", retval);
+		goto error_register_dev;
+	}
+	kraken_netlink_add(kraken);
+
 	if (update_interval_initial == 0) {
-		kraken->update_interval = ktime_set(0, 0);
 		dev_info(&interface->dev,
 		         "not starting updates: interval set to 0\n");
 	} else {
 		kraken->update_interval = ms_to_ktime(
 			max((u64) update_interval_initial,
 			    UPDATE_INTERVAL_MIN_MS));
-		hrtimer_start(&kraken->update_timer, kraken->update_interval,
-		              HRTIMER_MODE_REL);
+		kraken->update_interval_set = kraken->update_interval;
+		kraken_update_timer_start(kraken, kraken->update_interval);
 	}
 
-	kraken->update_retval = 0;
+	// the device may be suspended between updates, as long as the interval
+	// is longer than the autosuspend delay
+	if (autosuspend)
+		usb_enable_autosuspend(udev);
 
 	return 0;
+error_register_dev:
+	kraken_remove_device_files(interface);
 error_create_files:
 	kraken_driver_disconnect(interface);
 error_driver_probe:
+	kraken_stats_remove(kraken);
+error_stats:
+	kraken_ring_put(kraken->ring);
+error_ring:
+	destroy_workqueue(kraken->update_workqueue);
+error_workqueue:
 	usb_set_intfdata(interface, NULL);
 	usb_put_dev(kraken->udev);
 	kfree(kraken);
@@ -196,17 +1454,76 @@ error_kraken:
 void kraken_disconnect(struct usb_interface *interface)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
+	unsigned long flags;
+
+	// no more commands or opens of the character device from here on, nor
+	// writes to the attributes; the driver's other writers, such as hwmon,
+	// go on until the driver disconnects, but can't queue work any more
+	kraken_netlink_remove(kraken);
+	usb_deregister_dev(interface, &kraken->class);
+	kraken_remove_device_files(interface);
+	spin_lock_irqsave(&kraken->update_lock, flags);
+	kraken->disconnected = true;
+	spin_unlock_irqrestore(&kraken->update_lock, flags);
 
 	hrtimer_cancel(&kraken->update_timer);
+	cancel_delayed_work_sync(&kraken->dispatch_work);
 	flush_workqueue(kraken->update_workqueue);
 	destroy_workqueue(kraken->update_workqueue);
-	kraken->update_sync_condition = true;
+	// release any waiting update syncs for good
+	atomic64_inc(&kraken->update_generation);
 	wake_up_all(&kraken->update_sync_waitqueue);
 
-	kraken_remove_device_files(interface);
 	kraken_driver_disconnect(interface);
+	kraken_stats_remove(kraken);
+	// any open files keep the ring until closed
+	kraken_ring_put(kraken->ring);
 
 	usb_set_intfdata(interface, NULL);
 	usb_put_dev(kraken->udev);
 	kfree(kraken);
 }
+
+int kraken_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(interface);
+
+	// autosuspended: no update is running, as they keep the device awake,
+	// and the next one will resume the device itself.  Otherwise, the
+	// updates are stopped until resumed.
+	if (!PMSG_IS_AUTO(message)) {
+		kraken->update_suspended = true;
+		hrtimer_cancel(&kraken->update_timer);
+		cancel_delayed_work_sync(&kraken->dispatch_work);
+		flush_workqueue(kraken->update_workqueue);
+	}
+	kraken_driver_suspend(kraken);
+	usb_kill_anchored_urbs(&kraken->update_anchor);
+	return 0;
+}
+
+static int kraken_resume_common(struct usb_interface *interface, bool reset)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(interface);
+	int retval = kraken_driver_resume(kraken, reset);
+	if (retval)
+		dev_err(&interface->dev, "failed to resume: %d\n", retval);
+
+	if (kraken->update_suspended) {
+		kraken->update_suspended = false;
+		if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) != 0)
+			kraken_update_timer_start(kraken,
+			                          kraken->update_interval);
+	}
+	return retval;
+}
+
+int kraken_resume(struct usb_interface *interface)
+{
+	return kraken_resume_common(interface, false);
+}
+
+int kraken_reset_resume(struct usb_interface *interface)
+{
+	return kraken_resume_common(interface, true);
+}
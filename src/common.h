@@ -5,12 +5,63 @@
 #ifndef LEVIATHAN_COMMON_H_INCLUDED
 #define LEVIATHAN_COMMON_H_INCLUDED
 
+#include "curve.h"
+#include "pid.h"
+#include "uapi/leviathan.h"
+#include "window.h"
+
+#include <linux/atomic.h>
 #include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/usb.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 
+struct dentry;
 struct kraken_driver_data;
+struct kraken_ring;
+struct kraken_stats;
+
+/**
+ * A pool of DMA-coherent transfer buffers, carved out of a single
+ * usb_alloc_coherent() allocation.  Buffers are taken from the pool at probe
+ * and never given back individually; the whole pool is freed at disconnect.
+ */
+struct kraken_buffers {
+	u8 *buffer;
+	dma_addr_t dma;
+	size_t size;
+	size_t used;
+};
+
+/**
+ * The readings of a device's status.
+ */
+struct kraken_readings {
+	// in °C
+	u8 temp_liquid;
+	// in RPM
+	u16 fan_rpm;
+	u16 pump_rpm;
+};
+
+#define KRAKEN_BUFFER_ALIGN ((size_t) 8)
+
+/**
+ * The space a buffer of the given size takes up in the pool.
+ */
+#define KRAKEN_BUFFER_SIZE(size) ALIGN((size_t) (size), KRAKEN_BUFFER_ALIGN)
+
+/**
+ * The percents settable on every device.
+ */
+enum kraken_percent {
+	KRAKEN_PERCENT_FAN,
+	KRAKEN_PERCENT_PUMP,
+	KRAKEN_PERCENTS,
+};
 
 /**
  * The custom data stored in the interface, retrievable by usb_get_intfdata().
@@ -24,18 +75,119 @@ struct usb_kraken {
 	// any update syncs waiting for an update wait on this; updates wake
 	// everything on this up
 	struct wait_queue_head update_sync_waitqueue;
-	// waiting update syncs set this to false; updates set it to true
-	bool update_sync_condition;
+	// incremented by each finished update; each waiting update sync waits
+	// for it to change from the value it saw when it started waiting
+	atomic64_t update_generation;
 
-	// the update work and queue
+	// the update work and queue, and when the timer last queued the work
 	struct workqueue_struct *update_workqueue;
 	struct work_struct update_work;
+	ktime_t update_queued;
 	// the update interval and timer (a value of ktime_set(0, 0) means that
 	// updates are halted)
 	ktime_t update_interval;
 	struct hrtimer update_timer;
-	// the last update's success
+	// the last update's success, and when the current one started
 	int update_retval;
+	ktime_t update_start;
+	// set while the updates are stopped for system sleep
+	bool update_suspended;
+	// set under update_lock once disconnecting, after which no work may be
+	// queued any more
+	bool disconnected;
+	// the update interval as last set by the user, which the update
+	// interval differs from only when adapted
+	ktime_t update_interval_set;
+	// protects changes of the update interval
+	spinlock_t update_lock;
+	// by how much the update timer may be delayed to share a wakeup with
+	// other timers (at most half the interval is used)
+	ktime_t update_slack;
+	// the nr of update timer wakeups on schedule, and of those which came
+	// early, piggybacking on another wakeup within the slack
+	atomic_long_t update_wakeups_forced;
+	atomic_long_t update_wakeups_coalesced;
+
+	// the longest round trip of an update measured by the last
+	// calibration, or ktime_set(0, 0) if never calibrated successfully
+	ktime_t update_rtt;
+	struct work_struct calibrate_work;
+	int calibrate_retval;
+	// if set, the update interval may go below the normal minimum, down to
+	// a multiple of the measured round trip
+	bool fast;
+
+	// if set, the update interval adapts to the rate of change of the
+	// readings, within the given bounds (in ms)
+	bool adaptive;
+	u64 adaptive_min_ms;
+	u64 adaptive_max_ms;
+	unsigned int adaptive_aggressiveness;
+	// the readings of the previous update, if primed
+	struct kraken_readings adaptive_readings;
+	bool adaptive_primed;
+	// set by writes, which shrink the interval to the minimum
+	atomic_t adaptive_written;
+
+	// if set, writes dispatch an update right away, instead of waiting for
+	// the next timer tick; dispatches are at least the given interval apart
+	bool dispatch_immediate;
+	ktime_t dispatch_interval;
+	ktime_t dispatch_last;
+	struct delayed_work dispatch_work;
+
+	// bitmap of driver-specific commands written since they were last taken
+	// by an update; any nr of writes of a command between two updates
+	// collapse into one, sending only the latest value
+	unsigned long commands_dirty;
+	// nr of command writes received, and of frames sent for them
+	atomic_long_t commands_written;
+	atomic_long_t command_frames_sent;
+
+	// URBs submitted during an update are anchored here, so that the update
+	// can wait for all of them at once
+	struct usb_anchor update_anchor;
+	// the first error reported by any URB of the current update
+	atomic_t update_urb_error;
+
+	// the transfer buffers of the driver's URBs
+	struct kraken_buffers buffers;
+
+	// the history of telemetry samples, mappable through the character
+	// device registered with the class driver
+	struct kraken_ring *ring;
+	char class_name[32];
+	struct usb_class_driver class;
+
+	// in the list of devices reachable through generic netlink
+	struct list_head netlink_node;
+
+	// the curves or PID controllers controlling the percents, run by each
+	// update; at most one of the two on for each percent
+	struct mutex control_lock;
+	struct kraken_curve curves[KRAKEN_PERCENTS];
+	struct kraken_pid pids[KRAKEN_PERCENTS];
+
+	// statistics of the readings over windows of time
+	struct kraken_windows windows;
+
+	// per-CPU counters of the traffic and updates, and their debugfs
+	// directory
+	struct kraken_stats __percpu *stats;
+	struct dentry *debugfs;
+};
+
+/**
+ * The types of messages exchanged with devices, told apart by the statistics.
+ */
+enum kraken_msg {
+	KRAKEN_MSG_STATUS,
+	KRAKEN_MSG_PERCENT,
+	KRAKEN_MSG_LED,
+	// driver kraken's control and bulk messages other than the status
+	KRAKEN_MSG_CONTROL,
+	KRAKEN_MSG_BULK,
+	KRAKEN_MSGS,
 };
 
 /**
@@ -43,6 +195,11 @@ struct usb_kraken {
  */
 extern const char *kraken_driver_name;
 
+/**
+ * The driver itself, to find the devices of its character devices.
+ */
+extern struct usb_driver *const kraken_usb_driver;
+
 /**
  * Driver-specific probe called from kraken_probe().  Driver-specific data must
  * be allocated here.
@@ -61,6 +218,76 @@ extern void kraken_driver_disconnect(struct usb_interface *interface);
  */
 extern int kraken_driver_update(struct usb_kraken *kraken);
 
+/**
+ * Perform a round trip to the device representative of a full update, to be
+ * timed by calibrations.  Runs on the update workqueue, serialized with the
+ * updates.  Return 0 on success, or a negative error number.
+ */
+extern int kraken_driver_calibrate(struct usb_kraken *kraken);
+
+/**
+ * Stop any I/O of the driver's own before the device is suspended.
+ */
+extern void kraken_driver_suspend(struct usb_kraken *kraken);
+
+/**
+ * Restart any I/O of the driver's own after the device is resumed.  If reset,
+ * the device has lost its state: whatever has been applied to it must be marked
+ * to be sent again.  Return 0 on success, or a negative error number.
+ */
+extern int kraken_driver_resume(struct usb_kraken *kraken, bool reset);
+
+/**
+ * Fill in the latest sample of the device's status, all but the version and
+ * size.  Must not block.
+ */
+extern void kraken_driver_telemetry(struct usb_kraken *kraken,
+                                    struct leviathan_telemetry *telemetry);
+
+/**
+ * The device's serial number; an empty string if unknown.
+ */
+extern const char *kraken_driver_serial(struct usb_kraken *kraken);
+
+/**
+ * Write a percent, to be sent by the next update, as if written to its
+ * attribute.  Return 0 on success, or a negative error number.
+ */
+extern int kraken_driver_percent_write(struct usb_kraken *kraken,
+                                       enum kraken_percent which,
+                                       unsigned int percent);
+
+/**
+ * The bounds a percent is clamped to.
+ */
+extern void kraken_driver_percent_bounds(struct usb_kraken *kraken,
+                                         enum kraken_percent which,
+                                         u8 *min, u8 *max);
+
+/**
+ * Set the percents computed by the in-kernel control, within their bounds, to
+ * be sent by the current update.  Unlike writes, these aren't counted as
+ * writes, nor dispatch updates.  Percents not under control are negative.
+ */
+extern void
+kraken_driver_percents_control(struct usb_kraken *kraken,
+                               const int percents[KRAKEN_PERCENTS]);
+
+/**
+ * Set what a batch of the character device sets, as if written to the
+ * attributes.  Everything must be validated before anything is set: either all
+ * is set, or nothing.  Return 0 on success, -EINVAL if anything is invalid, or
+ * -EOPNOTSUPP if anything isn't supported by the device.
+ */
+extern int kraken_driver_batch(struct usb_kraken *kraken,
+                               const struct leviathan_batch *batch);
+
+/**
+ * Get the readings of the device's latest status.  Called after updates.
+ */
+extern void kraken_driver_readings(struct usb_kraken *kraken,
+                                   struct kraken_readings *readings);
+
 /**
  * Create driver-specific device attribute files.  Called from kraken_probe().
  */
@@ -72,8 +299,101 @@ extern int kraken_driver_create_device_files(struct usb_interface *interface);
  */
 extern void kraken_driver_remove_device_files(struct usb_interface *interface);
 
+/**
+ * Get the latest sample of the device's status.  Never blocks.
+ */
+void kraken_telemetry(struct usb_kraken *kraken,
+                      struct leviathan_telemetry *telemetry);
+
+/**
+ * Append the latest sample of the device's status to the telemetry history.
+ * Called by the driver whenever a status message is received.  Safe to call
+ * from URB completion handlers.
+ */
+void kraken_telemetry_push(struct usb_kraken *kraken);
+
+/**
+ * Mark a command as written, to be sent by the next update.  Must be called
+ * after the command's new value has been stored.  In immediate dispatch mode,
+ * this also dispatches an update (rate-limited).
+ */
+void kraken_command_write(struct usb_kraken *kraken, unsigned int command);
+
+/**
+ * Mark several commands as written together, counted as a single write, like
+ * kraken_command_write().
+ */
+void kraken_commands_write(struct usb_kraken *kraken, unsigned long commands);
+
+/**
+ * Mark commands to be sent (again) by the next update, without counting them
+ * as written, e.g. after failing to send them.  Safe to call from URB
+ * completion handlers.
+ */
+void kraken_commands_resend(struct usb_kraken *kraken, unsigned long commands);
+
+/**
+ * Take the bitmap of commands to be sent by the current update, clearing it.
+ */
+unsigned long kraken_commands_take(struct usb_kraken *kraken);
+
+/**
+ * Count frames sent by the current update for the commands taken.
+ */
+void kraken_command_frames_sent(struct usb_kraken *kraken, unsigned int frames);
+
+/**
+ * Allocate the pool of transfer buffers.  The size must account for every
+ * buffer by KRAKEN_BUFFER_SIZE().
+ */
+int kraken_buffers_alloc(struct usb_kraken *kraken, size_t size);
+void kraken_buffers_free(struct usb_kraken *kraken);
+
+/**
+ * Take a buffer of the given size from the pool, and make it the transfer
+ * buffer of an already filled URB.  Returns -ENOMEM if the pool is exhausted.
+ */
+int kraken_urb_buffer(struct usb_kraken *kraken, struct urb *urb, size_t size);
+
+/**
+ * Anchor an URB to the current update and submit it.  The URB's completion
+ * handler must report any failure by kraken_urb_error().
+ */
+int kraken_urb_submit(struct usb_kraken *kraken, struct urb *urb,
+                      gfp_t mem_flags);
+
+/**
+ * Trace the submission, at the given time, of an URB submitted other than by
+ * kraken_urb_submit(), and so not part of an update.
+ */
+void kraken_urb_trace_submit(struct usb_kraken *kraken, struct urb *urb,
+                             ktime_t submitted);
+
+/**
+ * Trace and count the completion of an URB of the given message type, which
+ * was submitted at the given time.  Called first thing by completion handlers.
+ */
+void kraken_urb_complete(struct usb_kraken *kraken, struct urb *urb,
+                         enum kraken_msg msg, ktime_t submitted);
+
+/**
+ * Record an error of the current update.  Only the first error is kept.  Safe
+ * to call from URB completion handlers.
+ */
+void kraken_urb_error(struct usb_kraken *kraken, int error);
+
+/**
+ * Wait until every URB submitted during the current update has completed, or
+ * kill the remaining ones after the timeout.  Returns the first error recorded
+ * during the update, and resets it.
+ */
+int kraken_urbs_wait(struct usb_kraken *kraken, unsigned int timeout_ms);
+
 int kraken_probe(struct usb_interface *interface,
                  const struct usb_device_id *id);
 void kraken_disconnect(struct usb_interface *interface);
+int kraken_suspend(struct usb_interface *interface, pm_message_t message);
+int kraken_resume(struct usb_interface *interface);
+int kraken_reset_resume(struct usb_interface *interface);
 
 #endif  /* LEVIATHAN_COMMON_H_INCLUDED */
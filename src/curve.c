@@ -0,0 +1,116 @@
+/* Implementation of the temperature-to-percent curves.
+ */
+
+#include "curve.h"
+#include "common.h"
+#include "util.h"
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+#define CURVE_SOURCE_LIQUID "liquid"
+
+// the liquid temperature is stale once older than this many update intervals,
+// and at least this many ms
+#define CURVE_TEMP_AGE_INTERVALS 3
+#define CURVE_TEMP_AGE_MIN_MS 3000
+
+int kraken_curve_parse(struct kraken_curve *curve, const char *buf)
+{
+	char word[WORD_LEN_MAX];
+	int ret = str_scan_word(&buf, word);
+	if (ret)
+		return -EINVAL;
+
+	memset(curve, 0, sizeof(*curve));
+	if (strcmp(word, "none") == 0)
+		return buf[0] == '\0' ? 0 : -EINVAL;
+	// the only source: thermal zones would come without a reference, so
+	// nothing would keep them from going away while read
+	if (strcmp(word, CURVE_SOURCE_LIQUID) != 0)
+		return -EINVAL;
+
+	// points TEMP:PERCENT, in °C and percents
+	while (buf[0] != '\0') {
+		char *colon;
+		int temp;
+		u8 percent;
+		if (curve->points == KRAKEN_CURVE_POINTS_MAX ||
+		    str_scan_word(&buf, word))
+			return -EINVAL;
+		colon = strchr(word, ':');
+		if (colon == NULL)
+			return -EINVAL;
+		*colon = '\0';
+		if (kstrtoint(word, 10, &temp) ||
+		    kstrtou8(colon + 1, 10, &percent) || percent > 100 ||
+		    temp < -273 || temp > 1000)
+			return -EINVAL;
+		temp *= 1000;
+		if (curve->points > 0 &&
+		    temp <= curve->temps[curve->points - 1])
+			return -EINVAL;
+		curve->temps[curve->points] = temp;
+		curve->percents[curve->points] = percent;
+		curve->points++;
+	}
+	return curve->points == 0 ? -EINVAL : 0;
+}
+
+ssize_t kraken_curve_show(const struct kraken_curve *curve, char *buf)
+{
+	ssize_t len;
+	unsigned int i;
+	if (curve->points == 0)
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	len = scnprintf(buf, PAGE_SIZE, "%s", CURVE_SOURCE_LIQUID);
+	for (i = 0; i < curve->points; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, " %d:%u",
+		                 curve->temps[i] / 1000, curve->percents[i]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+int kraken_curve_temp(struct usb_kraken *kraken, int *temp)
+{
+	struct leviathan_telemetry telemetry;
+
+	kraken_telemetry(kraken, &telemetry);
+	if (telemetry.sequence == 0)
+		return -ENODATA;
+	// the status has stopped coming: no ground for controlling on
+	if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) != 0) {
+		const ktime_t age = ktime_sub(
+			ktime_get(), ns_to_ktime(telemetry.timestamp_ns));
+		const ktime_t age_max = max(
+			ktime_mul(kraken->update_interval,
+			          CURVE_TEMP_AGE_INTERVALS),
+			ms_to_ktime(CURVE_TEMP_AGE_MIN_MS));
+		if (ktime_compare(age, age_max) > 0)
+			return -ESTALE;
+	}
+	*temp = telemetry.temp_liquid * 1000;
+	return 0;
+}
+
+unsigned int kraken_curve_eval(const struct kraken_curve *curve, int temp)
+{
+	const unsigned int last = curve->points - 1;
+	unsigned int i;
+	int dp, dt;
+
+	if (temp <= curve->temps[0])
+		return curve->percents[0];
+	if (temp >= curve->temps[last])
+		return curve->percents[last];
+	for (i = 1; temp > curve->temps[i]; i++)
+		;
+	// interpolate between points i - 1 and i, rounding to the closest;
+	// within range of an int, as the temperatures are bounded
+	dp = (int) curve->percents[i] - (int) curve->percents[i - 1];
+	dt = curve->temps[i] - curve->temps[i - 1];
+	return curve->percents[i - 1] +
+		DIV_ROUND_CLOSEST(dp * (temp - curve->temps[i - 1]), dt);
+}
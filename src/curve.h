@@ -0,0 +1,49 @@
+/* Piecewise-linear curves mapping a temperature to a percent, evaluated by the
+ * updates to control the fan and pump without any help from userspace.
+ */
+
+#ifndef LEVIATHAN_CURVE_H_INCLUDED
+#define LEVIATHAN_CURVE_H_INCLUDED
+
+#include <linux/types.h>
+
+struct usb_kraken;
+
+#define KRAKEN_CURVE_POINTS_MAX 16
+
+/**
+ * A curve of the liquid temperature, through its points in order of strictly
+ * increasing temperature, and flat beyond its first and last point.
+ * @points: the nr of points; 0 if the curve is off
+ */
+struct kraken_curve {
+	unsigned int points;
+	// in m°C
+	int temps[KRAKEN_CURVE_POINTS_MAX];
+	u8 percents[KRAKEN_CURVE_POINTS_MAX];
+};
+
+/**
+ * Parse a curve as written to attribute `fan_curve` or `pump_curve`.  Returns
+ * -EINVAL if invalid.
+ */
+int kraken_curve_parse(struct kraken_curve *curve, const char *buf);
+
+/**
+ * Print a curve as read from attribute `fan_curve` or `pump_curve`.
+ */
+ssize_t kraken_curve_show(const struct kraken_curve *curve, char *buf);
+
+/**
+ * Get the liquid temperature in m°C, which the curves and PID controllers run
+ * on.  Returns -ENODATA if the device hasn't reported its status yet, or
+ * -ESTALE if its last status is older than a few update intervals.
+ */
+int kraken_curve_temp(struct usb_kraken *kraken, int *temp);
+
+/**
+ * Evaluate a curve, which must be on, at the given temperature in m°C.
+ */
+unsigned int kraken_curve_eval(const struct kraken_curve *curve, int temp);
+
+#endif  /* LEVIATHAN_CURVE_H_INCLUDED */
@@ -2,74 +2,317 @@
  */
 
 #include "../common.h"
-
+#include "../netlink.h"
+#include "../stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "../trace.h"
+
+#include <linux/bitops.h>
+#include <linux/build_bug.h>
+#include <linux/err.h>
+#include <linux/hwmon.h>
+#include <linux/init.h>
+#include <linux/kconfig.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/usb.h>
 
 #define DRIVER_NAME "kraken"
 
+// the commands of the device, as bits in the kraken's dirty bitmap
+enum kraken_command {
+	COMMAND_COLOR,
+	COMMAND_SPEED,
+};
+
 struct kraken_driver_data {
 	// TODO: it would be nice to protect these messages from data races by
-	// mutexes, like in kraken_x62.  They shouldn't happen frequently, and
+	// locks, like in kraken_x62.  They shouldn't happen frequently, and
 	// it's not exactly a huge problem if they happen, but lack of data
 	// races ought to be an objective for all programs, especially drivers.
-	bool send_color;
 	u8 color_message[19];
 	u8 pump_message[2];
 	u8 fan_message[2];
 	u8 status_message[32];
+	// the nr of status messages received so far, and when the last one was
+	u64 status_sequence;
+	ktime_t status_received;
+	// the status is received in a completion handler; readers retry rather
+	// than block it, and always see a whole message
+	seqlock_t status_lock;
+	// the speed last applied to the device, or 0 if none
+	u8 speed_applied;
+
+	// the hwmon device, if registered
+	struct device *hwmon;
+
+	// the commands sent by the current transaction
+	unsigned long transaction_commands;
+	// when the control URB was submitted, and then the rest, which each
+	// message's latency is counted from
+	ktime_t transaction_submitted;
+	ktime_t messages_submitted;
+	// pre-allocated URBs transferring the messages, with DMA-coherent
+	// transfer buffers; the control URB starts each transaction and its
+	// completion submits the rest
+	struct usb_ctrlrequest *transaction_setup;
+	struct urb *transaction_urb;
+	struct urb *color_urb;
+	struct urb *pump_urb;
+	struct urb *fan_urb;
+	struct urb *status_urb;
 };
 
-static int kraken_start_transaction(struct usb_kraken *kraken)
+#define BUFFERS_SIZE (KRAKEN_BUFFER_SIZE(19) + 2 * KRAKEN_BUFFER_SIZE(2) + KRAKEN_BUFFER_SIZE(32))
+
+static void kraken_message_check(struct usb_kraken *kraken, struct urb *urb)
 {
-	return usb_control_msg(kraken->udev, usb_sndctrlpipe(kraken->udev, 0), 2, 0x40, 0x0001, 0, NULL, 0, 1000);
+	if (urb->status)
+		kraken_urb_error(kraken, urb->status);
+	else if (urb->actual_length != urb->transfer_buffer_length)
+		kraken_urb_error(kraken, -EIO);
 }
 
-static int kraken_send_message(struct usb_kraken *kraken, u8 *message, int length)
+static void kraken_message_complete(struct urb *urb)
 {
-	int sent;
-	int retval = usb_bulk_msg(kraken->udev, usb_sndbulkpipe(kraken->udev, 2), message, length, &sent, 3000);
-	if (retval != 0)
-		return retval;
-	if (sent != length)
-		return -EIO;
-	return 0;
+	struct usb_kraken *kraken = urb->context;
+	kraken_urb_complete(kraken, urb, KRAKEN_MSG_BULK, kraken->data->messages_submitted);
+	kraken_message_check(kraken, urb);
 }
 
-static int kraken_receive_message(struct usb_kraken *kraken, u8 message[], int expected_length)
+static void kraken_status_complete(struct urb *urb)
 {
-	int received;
-	int retval = usb_bulk_msg(kraken->udev, usb_rcvbulkpipe(kraken->udev, 2), message, expected_length, &received, 3000);
-	if (retval != 0)
-		return retval;
-	if (received != expected_length)
-		return -EIO;
-	return 0;
+	struct usb_kraken *kraken = urb->context;
+	struct kraken_driver_data *data = kraken->data;
+	unsigned long flags;
+	kraken_urb_complete(kraken, urb, KRAKEN_MSG_STATUS, data->messages_submitted);
+	kraken_message_check(kraken, urb);
+	if (!urb->status && urb->actual_length == urb->transfer_buffer_length) {
+		write_seqlock_irqsave(&data->status_lock, flags);
+		memcpy(data->status_message, urb->transfer_buffer, sizeof(data->status_message));
+		data->status_sequence++;
+		data->status_received = ktime_get();
+		write_sequnlock_irqrestore(&data->status_lock, flags);
+		kraken_telemetry_push(kraken);
+	}
+}
+
+static void kraken_status_snapshot(struct kraken_driver_data *data, u8 status[32])
+{
+	unsigned int seq;
+	do {
+		seq = read_seqbegin(&data->status_lock);
+		memcpy(status, data->status_message, sizeof(data->status_message));
+	} while (read_seqretry(&data->status_lock, seq));
+}
+
+static void kraken_transaction_complete(struct urb *urb)
+{
+	struct usb_kraken *kraken = urb->context;
+	struct kraken_driver_data *data = kraken->data;
+	int retval;
+	kraken_urb_complete(kraken, urb, KRAKEN_MSG_CONTROL, data->transaction_submitted);
+	if (urb->status) {
+		kraken_urb_error(kraken, urb->status);
+		return;
+	}
+	// the transaction has started: send all messages back-to-back (they
+	// arrive in order, as they share an endpoint) and receive the status
+	data->messages_submitted = ktime_get();
+	if (
+		(data->transaction_commands & BIT(COMMAND_COLOR) && (retval = kraken_urb_submit(kraken, data->color_urb, GFP_ATOMIC))) ||
+		(data->transaction_commands & BIT(COMMAND_SPEED) && (retval = kraken_urb_submit(kraken, data->pump_urb, GFP_ATOMIC))) ||
+		(data->transaction_commands & BIT(COMMAND_SPEED) && (retval = kraken_urb_submit(kraken, data->fan_urb, GFP_ATOMIC))) ||
+		(retval = kraken_urb_submit(kraken, data->status_urb, GFP_ATOMIC))
+	   )
+		kraken_urb_error(kraken, retval);
+}
+
+static struct urb *kraken_message_urb(struct usb_kraken *kraken, unsigned int pipe, int length, usb_complete_t complete)
+{
+	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return NULL;
+	usb_fill_bulk_urb(urb, kraken->udev, pipe, NULL, 0, complete, kraken);
+	if (kraken_urb_buffer(kraken, urb, length)) {
+		usb_free_urb(urb);
+		return NULL;
+	}
+	return urb;
+}
+
+static struct urb *kraken_transaction_urb(struct usb_kraken *kraken, struct usb_ctrlrequest *setup)
+{
+	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return NULL;
+	setup->bRequestType = 0x40;
+	setup->bRequest = 2;
+	setup->wValue = cpu_to_le16(0x0001);
+	setup->wIndex = cpu_to_le16(0);
+	setup->wLength = cpu_to_le16(0);
+	usb_fill_control_urb(urb, kraken->udev, usb_sndctrlpipe(kraken->udev, 0), (u8 *) setup, NULL, 0, kraken_transaction_complete, kraken);
+	return urb;
 }
 
 int kraken_driver_update(struct usb_kraken *kraken)
 {
-	int retval = 0;
+	int retval;
 	struct kraken_driver_data *data = kraken->data;
-	if (data->send_color) {
-		if (
-			(retval = kraken_start_transaction(kraken)) ||
-			(retval = kraken_send_message(kraken, data->color_message, 19)) ||
-			(retval = kraken_receive_message(kraken, data->status_message, 32))
-		   )
-			dev_err(&kraken->udev->dev, "Failed to update: %d\n", retval);
-		data->send_color = false;
+	// each transaction is either a color message, or the pump and fan speed
+	// messages, as by the protocol; the speeds are sent whether written or
+	// not, as the device isn't known to keep them otherwise, and a speed
+	// written along with a color waits for the next transaction
+	const unsigned long commands = kraken_commands_take(kraken);
+	if (commands & BIT(COMMAND_COLOR)) {
+		data->transaction_commands = BIT(COMMAND_COLOR);
+		kraken_commands_resend(kraken, commands & BIT(COMMAND_SPEED));
+		memcpy(data->color_urb->transfer_buffer, data->color_message, sizeof(data->color_message));
 	} else {
-		if (
-			(retval = kraken_start_transaction(kraken)) ||
-			(retval = kraken_send_message(kraken, data->pump_message, 2)) ||
-			(retval = kraken_send_message(kraken, data->fan_message, 2)) ||
-			(retval = kraken_receive_message(kraken, data->status_message, 32))
-		   )
-			dev_err(&kraken->udev->dev, "Failed to update: %d\n", retval);
+		data->transaction_commands = BIT(COMMAND_SPEED);
+		memcpy(data->pump_urb->transfer_buffer, data->pump_message, sizeof(data->pump_message));
+		memcpy(data->fan_urb->transfer_buffer, data->fan_message, sizeof(data->fan_message));
 	}
-	return retval;
+
+	data->transaction_submitted = ktime_get();
+	if ((retval = kraken_urb_submit(kraken, data->transaction_urb, GFP_KERNEL)))
+		kraken_urb_error(kraken, retval);
+	if ((retval = kraken_urbs_wait(kraken, 3000))) {
+		dev_err(&kraken->udev->dev, "Failed to update: %d\n", retval);
+		// resend the messages in the next transaction
+		kraken_commands_resend(kraken, commands);
+		return retval;
+	}
+	// only the frames sent for writes count, once actually sent
+	if (data->transaction_commands & BIT(COMMAND_COLOR)) {
+		kraken_command_frames_sent(kraken, 1);
+	} else {
+		WRITE_ONCE(data->speed_applied, ((u8 *) data->pump_urb->transfer_buffer)[1]);
+		if (commands & BIT(COMMAND_SPEED))
+			kraken_command_frames_sent(kraken, 2);
+	}
+	return 0;
+}
+
+int kraken_driver_calibrate(struct usb_kraken *kraken)
+{
+	int retval;
+	struct kraken_driver_data *data = kraken->data;
+	// an update's round trip, without sending anything: the control
+	// transfer and the status only, leaving whatever's written to the updates
+	data->transaction_commands = 0;
+	data->transaction_submitted = ktime_get();
+	if ((retval = kraken_urb_submit(kraken, data->transaction_urb, GFP_KERNEL)))
+		kraken_urb_error(kraken, retval);
+	return kraken_urbs_wait(kraken, 3000);
+}
+
+void kraken_driver_suspend(struct usb_kraken *kraken)
+{
+}
+
+int kraken_driver_resume(struct usb_kraken *kraken, bool reset)
+{
+	// the messages are always complete, so they can just be sent again
+	if (reset)
+		kraken_commands_resend(kraken, BIT(COMMAND_COLOR) | BIT(COMMAND_SPEED));
+	return 0;
+}
+
+void kraken_driver_telemetry(struct usb_kraken *kraken, struct leviathan_telemetry *telemetry)
+{
+	struct kraken_driver_data *data = kraken->data;
+	u8 status[32];
+	unsigned int seq;
+	BUILD_BUG_ON(sizeof(status) > sizeof(telemetry->frame));
+
+	do {
+		seq = read_seqbegin(&data->status_lock);
+		memcpy(status, data->status_message, sizeof(status));
+		telemetry->sequence = data->status_sequence;
+		telemetry->timestamp_ns = ktime_to_ns(data->status_received);
+	} while (read_seqretry(&data->status_lock, seq));
+
+	telemetry->fan_rpm = 256 * status[0] + status[1];
+	telemetry->pump_rpm = 256 * status[8] + status[9];
+	telemetry->temp_liquid = status[10];
+	// the fan and the pump are always set to the same speed
+	telemetry->fan_percent = READ_ONCE(data->speed_applied);
+	telemetry->pump_percent = telemetry->fan_percent;
+	telemetry->frame_size = sizeof(status);
+	memcpy(telemetry->frame, status, sizeof(status));
+}
+
+const char *kraken_driver_serial(struct usb_kraken *kraken)
+{
+	return kraken->udev->serial ? kraken->udev->serial : "";
+}
+
+int kraken_driver_percent_write(struct usb_kraken *kraken, enum kraken_percent which, unsigned int percent)
+{
+	struct kraken_driver_data *data = kraken->data;
+
+	// the fan and the pump are always set to the same speed, as by
+	// attribute speed
+	if (percent < 30 || percent > 100)
+		return -EINVAL;
+
+	data->pump_message[1] = percent;
+	data->fan_message[1] = percent;
+
+	kraken_command_write(kraken, COMMAND_SPEED);
+
+	return 0;
+}
+
+void kraken_driver_percent_bounds(struct usb_kraken *kraken, enum kraken_percent which, u8 *min, u8 *max)
+{
+	// as accepted by attribute speed
+	*min = 30;
+	*max = 100;
+}
+
+void kraken_driver_percents_control(struct usb_kraken *kraken, const int percents[KRAKEN_PERCENTS])
+{
+	struct kraken_driver_data *data = kraken->data;
+	// the fan and the pump share a speed: the higher percent of the two wins
+	const int speed = max(percents[KRAKEN_PERCENT_FAN], percents[KRAKEN_PERCENT_PUMP]);
+	if (speed < 0)
+		return;
+	// the messages are sent whenever marked, so only mark them if changed
+	if (data->pump_message[1] == speed && READ_ONCE(data->speed_applied) == speed)
+		return;
+	data->pump_message[1] = speed;
+	data->fan_message[1] = speed;
+	kraken_commands_resend(kraken, BIT(COMMAND_SPEED));
+}
+
+int kraken_driver_batch(struct usb_kraken *kraken, const struct leviathan_batch *batch)
+{
+	const u32 leds = LEVIATHAN_BATCH_LED_LOGO | LEVIATHAN_BATCH_LEDS_RING | LEVIATHAN_BATCH_LEDS_SYNC;
+	// the fan and the pump share a speed, so they can only be set together to the same percent
+	const bool fan = batch->set & LEVIATHAN_BATCH_FAN_PERCENT;
+	const bool pump = batch->set & LEVIATHAN_BATCH_PUMP_PERCENT;
+	if (batch->set & leds)
+		return -EOPNOTSUPP;
+	if (fan && pump && batch->fan_percent != batch->pump_percent)
+		return -EINVAL;
+	return kraken_driver_percent_write(kraken, fan ? KRAKEN_PERCENT_FAN : KRAKEN_PERCENT_PUMP, fan ? batch->fan_percent : batch->pump_percent);
+}
+
+void kraken_driver_readings(struct usb_kraken *kraken, struct kraken_readings *readings)
+{
+	u8 status[32];
+	kraken_status_snapshot(kraken->data, status);
+
+	readings->temp_liquid = status[10];
+	readings->fan_rpm = 256 * status[0] + status[1];
+	readings->pump_rpm = 256 * status[8] + status[9];
 }
 
 static ssize_t show_speed(struct device *dev, struct device_attribute *attr, char *buf)
@@ -92,6 +335,8 @@ static ssize_t set_speed(struct device *dev, struct device_attribute *attr, cons
 	data->pump_message[1] = speed;
 	data->fan_message[1] = speed;
 
+	kraken_command_write(kraken, COMMAND_SPEED);
+
 	return count;
 }
 
@@ -118,7 +363,7 @@ static ssize_t set_color(struct device *dev, struct device_attribute *attr, cons
 	data->color_message[2] = g;
 	data->color_message[3] = b;
 
-	data->send_color = true;
+	kraken_command_write(kraken, COMMAND_COLOR);
 
 	return count;
 }
@@ -146,7 +391,7 @@ static ssize_t set_alternate_color(struct device *dev, struct device_attribute *
 	data->color_message[5] = g;
 	data->color_message[6] = b;
 
-	data->send_color = true;
+	kraken_command_write(kraken, COMMAND_COLOR);
 
 	return count;
 }
@@ -172,7 +417,7 @@ static ssize_t set_interval(struct device *dev, struct device_attribute *attr, c
 
 	data->color_message[11] = interval; data->color_message[12] = interval;
 
-	data->send_color = true;
+	kraken_command_write(kraken, COMMAND_COLOR);
 
 	return count;
 }
@@ -218,7 +463,7 @@ static ssize_t set_mode(struct device *dev, struct device_attribute *attr, const
 	} else
 		return -EINVAL;
 
-	data->send_color = true;
+	kraken_command_write(kraken, COMMAND_COLOR);
 
 	return count;
 }
@@ -228,9 +473,10 @@ static DEVICE_ATTR(mode, S_IRUGO | S_IWUSR | S_IWGRP, show_mode, set_mode);
 static ssize_t show_temp(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	u8 status[32];
+	kraken_status_snapshot(kraken->data, status);
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", data->status_message[10]);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status[10]);
 }
 
 static DEVICE_ATTR(temp, S_IRUGO, show_temp, NULL);
@@ -238,9 +484,10 @@ static DEVICE_ATTR(temp, S_IRUGO, show_temp, NULL);
 static ssize_t show_pump(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	u8 status[32];
+	kraken_status_snapshot(kraken->data, status);
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * data->status_message[8] + data->status_message[9]);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * status[8] + status[9]);
 }
 
 static DEVICE_ATTR(pump, S_IRUGO, show_pump, NULL);
@@ -248,13 +495,138 @@ static DEVICE_ATTR(pump, S_IRUGO, show_pump, NULL);
 static ssize_t show_fan(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	u8 status[32];
+	kraken_status_snapshot(kraken->data, status);
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * data->status_message[0] + data->status_message[1]);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * status[0] + status[1]);
 }
 
 static DEVICE_ATTR(fan, S_IRUGO, show_fan, NULL);
 
+#if IS_REACHABLE(CONFIG_HWMON)
+
+static umode_t kraken_hwmon_is_visible(const void *drvdata, enum hwmon_sensor_types type, u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_temp:
+		if (attr == hwmon_temp_input || attr == hwmon_temp_label)
+			return 0444;
+		break;
+	case hwmon_fan:
+		if (attr == hwmon_fan_input || attr == hwmon_fan_label)
+			return 0444;
+		break;
+	case hwmon_pwm:
+		if (attr == hwmon_pwm_input)
+			return 0644;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int kraken_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	u8 status[32];
+
+	switch (type) {
+	case hwmon_temp:
+		kraken_status_snapshot(kraken->data, status);
+		// in m°C
+		*val = status[10] * 1000L;
+		return 0;
+	case hwmon_fan:
+		kraken_status_snapshot(kraken->data, status);
+		*val = channel == 0 ? 256 * status[0] + status[1] : 256 * status[8] + status[9];
+		return 0;
+	case hwmon_pwm:
+		// the fan and the pump are always set to the same speed
+		*val = DIV_ROUND_CLOSEST(READ_ONCE(kraken->data->speed_applied) * 255, 100);
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_hwmon_read_string(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		*str = "liquid";
+		return 0;
+	case hwmon_fan:
+		*str = channel == 0 ? "fan" : "pump";
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_hwmon_write(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	struct kraken_driver_data *data = kraken->data;
+	long speed;
+
+	if (type != hwmon_pwm || attr != hwmon_pwm_input)
+		return -EOPNOTSUPP;
+	// same range as attribute speed, which this sets for both channels
+	speed = DIV_ROUND_CLOSEST(val * 100, 255);
+	if (val < 0 || val > 255 || speed < 30 || speed > 100)
+		return -EINVAL;
+
+	data->pump_message[1] = speed;
+	data->fan_message[1] = speed;
+
+	kraken_command_write(kraken, COMMAND_SPEED);
+
+	return 0;
+}
+
+static const struct hwmon_ops kraken_hwmon_ops = {
+	.is_visible  = kraken_hwmon_is_visible,
+	.read        = kraken_hwmon_read,
+	.read_string = kraken_hwmon_read_string,
+	.write       = kraken_hwmon_write,
+};
+
+static const struct hwmon_channel_info *const kraken_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT | HWMON_F_LABEL, HWMON_F_INPUT | HWMON_F_LABEL),
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT, HWMON_PWM_INPUT),
+	NULL,
+};
+
+static const struct hwmon_chip_info kraken_hwmon_chip_info = {
+	.ops  = &kraken_hwmon_ops,
+	.info = kraken_hwmon_info,
+};
+
+static struct device *kraken_hwmon_register(struct usb_kraken *kraken)
+{
+	return hwmon_device_register_with_info(&kraken->interface->dev, DRIVER_NAME, kraken, &kraken_hwmon_chip_info, NULL);
+}
+
+static void kraken_hwmon_unregister(struct device *hwmon)
+{
+	hwmon_device_unregister(hwmon);
+}
+
+#else
+
+static struct device *kraken_hwmon_register(struct usb_kraken *kraken)
+{
+	return NULL;
+}
+
+static void kraken_hwmon_unregister(struct device *hwmon)
+{
+}
+
+#endif
+
 int kraken_driver_create_device_files(struct usb_interface *interface)
 {
 	int retval;
@@ -311,11 +683,29 @@ int kraken_driver_probe(struct usb_interface *interface, const struct usb_device
 	struct kraken_driver_data *data;
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	int retval = -ENOMEM;
-	kraken->data = kmalloc(sizeof(*kraken->data), GFP_KERNEL | GFP_DMA);
+	kraken->data = kzalloc(sizeof(*kraken->data), GFP_KERNEL);
 	if (!kraken->data)
 		goto error_data;
 	data = kraken->data;
 
+	seqlock_init(&data->status_lock);
+
+	if ((retval = kraken_buffers_alloc(kraken, BUFFERS_SIZE)))
+		goto error_buffers;
+	retval = -ENOMEM;
+	if (!(data->transaction_setup = kmalloc(sizeof(*data->transaction_setup), GFP_KERNEL)))
+		goto error_transaction_setup;
+	if (!(data->transaction_urb = kraken_transaction_urb(kraken, data->transaction_setup)))
+		goto error_transaction_urb;
+	if (!(data->color_urb = kraken_message_urb(kraken, usb_sndbulkpipe(kraken->udev, 2), 19, kraken_message_complete)))
+		goto error_color_urb;
+	if (!(data->pump_urb = kraken_message_urb(kraken, usb_sndbulkpipe(kraken->udev, 2), 2, kraken_message_complete)))
+		goto error_pump_urb;
+	if (!(data->fan_urb = kraken_message_urb(kraken, usb_sndbulkpipe(kraken->udev, 2), 2, kraken_message_complete)))
+		goto error_fan_urb;
+	if (!(data->status_urb = kraken_message_urb(kraken, usb_rcvbulkpipe(kraken->udev, 2), 32, kraken_status_complete)))
+		goto error_status_urb;
+
 	data->color_message[0] = 0x10;
 	data->color_message[1] = 0x00; data->color_message[2] = 0x00; data->color_message[3] = 0xff;
 	data->color_message[4] = 0x00; data->color_message[5] = 0xff; data->color_message[6] = 0x00;
@@ -334,11 +724,32 @@ int kraken_driver_probe(struct usb_interface *interface, const struct usb_device
 	if (retval)
 		goto error;
 
+	data->hwmon = kraken_hwmon_register(kraken);
+	if (IS_ERR(data->hwmon)) {
+		retval = PTR_ERR(data->hwmon);
+		dev_err(&interface->dev, "Failed to register hwmon: %d\n", retval);
+		goto error;
+	}
+
 	dev_info(&interface->dev, "Kraken connected\n");
-	data->send_color = true;
+	kraken_commands_resend(kraken, BIT(COMMAND_COLOR) | BIT(COMMAND_SPEED));
 
 	return 0;
 error:
+	usb_free_urb(data->status_urb);
+error_status_urb:
+	usb_free_urb(data->fan_urb);
+error_fan_urb:
+	usb_free_urb(data->pump_urb);
+error_pump_urb:
+	usb_free_urb(data->color_urb);
+error_color_urb:
+	usb_free_urb(data->transaction_urb);
+error_transaction_urb:
+	kfree(data->transaction_setup);
+error_transaction_setup:
+	kraken_buffers_free(kraken);
+error_buffers:
 	kfree(data);
 error_data:
 	return retval;
@@ -349,6 +760,15 @@ void kraken_driver_disconnect(struct usb_interface *interface)
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	struct kraken_driver_data *data = kraken->data;
 
+	if (data->hwmon)
+		kraken_hwmon_unregister(data->hwmon);
+	usb_free_urb(data->status_urb);
+	usb_free_urb(data->fan_urb);
+	usb_free_urb(data->pump_urb);
+	usb_free_urb(data->color_urb);
+	usb_free_urb(data->transaction_urb);
+	kfree(data->transaction_setup);
+	kraken_buffers_free(kraken);
 	kfree(data);
 
 	dev_info(&interface->dev, "Kraken disconnected\n");
@@ -362,15 +782,41 @@ static const struct usb_device_id kraken_x61_id_table[] = {
 MODULE_DEVICE_TABLE(usb, kraken_x61_id_table);
 
 static struct usb_driver kraken_x61_driver = {
-	.name       = DRIVER_NAME,
-	.probe      = kraken_probe,
-	.disconnect = kraken_disconnect,
-	.id_table   = kraken_x61_id_table,
+	.name                 = DRIVER_NAME,
+	.probe                = kraken_probe,
+	.disconnect           = kraken_disconnect,
+	.suspend              = kraken_suspend,
+	.resume               = kraken_resume,
+	.reset_resume         = kraken_reset_resume,
+	.id_table             = kraken_x61_id_table,
+	.supports_autosuspend = 1,
 };
 
 const char *kraken_driver_name = DRIVER_NAME;
+struct usb_driver *const kraken_usb_driver = &kraken_x61_driver;
+
+static int __init kraken_x61_init(void)
+{
+	int retval = kraken_netlink_init();
+	if (retval)
+		return retval;
+	kraken_stats_init();
+	if ((retval = usb_register(&kraken_x61_driver))) {
+		kraken_stats_exit();
+		kraken_netlink_exit();
+	}
+	return retval;
+}
+
+static void __exit kraken_x61_exit(void)
+{
+	usb_deregister(&kraken_x61_driver);
+	kraken_stats_exit();
+	kraken_netlink_exit();
+}
 
-module_usb_driver(kraken_x61_driver);
+module_init(kraken_x61_init);
+module_exit(kraken_x61_exit);
 
 MODULE_DESCRIPTION("driver for 2433:b200 devices (NZXT Kraken X61)");
 MODULE_LICENSE("GPL");
@@ -0,0 +1,224 @@
+/* Handling of the configuration attribute, applying several settings at once.
+ */
+
+#include "config.h"
+#include "driver_data.h"
+#include "../common.h"
+#include "../util.h"
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+void config_data_init(struct config_data *data)
+{
+	mutex_init(&data->lock);
+	data->staging = false;
+	memset(&data->staged, 0, sizeof(data->staged));
+}
+
+/* Parse a line `ATTRIBUTE VALUE` of a configuration into staged, validating
+ * the value as the attribute would.
+ */
+static int config_parse_line(struct kraken_driver_data *data,
+                             struct device *dev, const char *line,
+                             struct config_staged *staged)
+{
+	const struct {
+		const char *attr;
+		unsigned int command;
+		unsigned int *percent;
+		struct led_data *led;
+		struct led_batch *batch;
+	} attrs[] = {
+		{ "fan_percent", COMMAND_PERCENT_FAN, &staged->percent_fan },
+		{ "pump_percent", COMMAND_PERCENT_PUMP,
+		  &staged->percent_pump },
+		{ "led_logo", COMMAND_LED_LOGO, NULL, &data->led_logo,
+		  &staged->led_logo },
+		{ "leds_ring", COMMAND_LEDS_RING, NULL, &data->leds_ring,
+		  &staged->leds_ring },
+		{ "leds_sync", COMMAND_LEDS_SYNC, NULL, &data->leds_sync,
+		  &staged->leds_sync },
+	};
+	char attr[WORD_LEN_MAX];
+	size_t i;
+	int ret;
+
+	if (str_scan_word(&line, attr)) {
+		dev_warn(dev, "config: missing attribute\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < ARRAY_SIZE(attrs); i++) {
+		if (strcmp(attr, attrs[i].attr) == 0)
+			break;
+	}
+	if (i == ARRAY_SIZE(attrs)) {
+		dev_warn(dev, "config: invalid attribute %s\n", attr);
+		return -EINVAL;
+	}
+
+	if (attrs[i].percent != NULL)
+		ret = percent_parse(dev, attrs[i].attr, line,
+		                    attrs[i].percent);
+	else
+		ret = led_batch_parse(attrs[i].led, dev, attrs[i].attr, line,
+		                      attrs[i].batch);
+	if (ret)
+		return -EINVAL;
+	staged->set |= BIT(attrs[i].command);
+	return 0;
+}
+
+/* Parse the lines of a configuration into staged, stopping at the first
+ * invalid one.
+ */
+static int config_parse(struct kraken_driver_data *data, struct device *dev,
+                        const char *buf, struct config_staged *staged)
+{
+	char *copy, *lines, *line;
+	int ret = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (copy == NULL)
+		return -ENOMEM;
+	lines = copy;
+	while ((line = strsep(&lines, "\n")) != NULL) {
+		if (line[0] == '\0')
+			continue;
+		ret = config_parse_line(data, dev, line, staged);
+		if (ret)
+			break;
+	}
+	kfree(copy);
+	return ret;
+}
+
+/* Store a staged configuration and mark it to be sent, with the lock held.
+ */
+static void config_store(struct usb_kraken *kraken,
+                         const struct config_staged *staged)
+{
+	struct kraken_driver_data *data = kraken->data;
+
+	if (staged->set == 0)
+		return;
+	if (staged->set & BIT(COMMAND_PERCENT_FAN))
+		percent_data_store(&data->percent_fan, staged->percent_fan);
+	if (staged->set & BIT(COMMAND_PERCENT_PUMP))
+		percent_data_store(&data->percent_pump, staged->percent_pump);
+	if (staged->set & BIT(COMMAND_LED_LOGO))
+		led_data_store(&data->led_logo, &staged->led_logo);
+	if (staged->set & BIT(COMMAND_LEDS_RING))
+		led_data_store(&data->leds_ring, &staged->leds_ring);
+	if (staged->set & BIT(COMMAND_LEDS_SYNC))
+		led_data_store(&data->leds_sync, &staged->leds_sync);
+	kraken_commands_write(kraken, staged->set);
+}
+
+void config_apply(struct usb_kraken *kraken,
+                  const struct config_staged *staged)
+{
+	struct config_data *config = &kraken->data->config;
+	mutex_lock(&config->lock);
+	config_store(kraken, staged);
+	mutex_unlock(&config->lock);
+}
+
+int config_data_parse(struct usb_kraken *kraken, struct device *dev,
+                      const char *buf)
+{
+	struct config_data *config = &kraken->data->config;
+	struct config_staged *staged;
+	int ret = 0;
+
+	mutex_lock(&config->lock);
+	if (sysfs_streq(buf, "begin")) {
+		// any configuration staged so far is discarded
+		config->staging = true;
+		memset(&config->staged, 0, sizeof(config->staged));
+		goto out;
+	}
+	if (sysfs_streq(buf, "abort") || sysfs_streq(buf, "commit")) {
+		if (!config->staging) {
+			dev_warn(dev, "config: no configuration begun\n");
+			ret = -EINVAL;
+			goto out;
+		}
+		if (sysfs_streq(buf, "commit"))
+			config_store(kraken, &config->staged);
+		config->staging = false;
+		goto out;
+	}
+
+	// parse into a copy, so that an invalid configuration leaves no trace
+	staged = kmalloc(sizeof(*staged), GFP_KERNEL);
+	if (staged == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (config->staging)
+		memcpy(staged, &config->staged, sizeof(*staged));
+	else
+		memset(staged, 0, sizeof(*staged));
+	ret = config_parse(kraken->data, dev, buf, staged);
+	if (!ret) {
+		if (config->staging)
+			memcpy(&config->staged, staged, sizeof(*staged));
+		else
+			config_store(kraken, staged);
+	}
+	kfree(staged);
+out:
+	mutex_unlock(&config->lock);
+	return ret;
+}
+
+/* Print a line `ATTRIBUTE VALUE` of the current configuration, or nothing if
+ * the attribute was never written.
+ */
+static int config_show_line(char *buf, size_t size, const char *attr,
+                            struct percent_data *percent, struct led_data *led)
+{
+	int len, value_len;
+	if (percent != NULL) {
+		const u8 value = percent_data_written(percent);
+		return value == 0 ? 0 : scnprintf(buf, size, "%s %u\n", attr,
+		                                  value);
+	}
+	len = scnprintf(buf, size, "%s ", attr);
+	value_len = led_data_show(led, buf + len, size - len);
+	if (value_len == 0)
+		return 0;
+	len += value_len;
+	return len + scnprintf(buf + len, size - len, "\n");
+}
+
+ssize_t config_data_show(struct usb_kraken *kraken, char *buf)
+{
+	struct kraken_driver_data *data = kraken->data;
+	const struct {
+		const char *attr;
+		struct percent_data *percent;
+		struct led_data *led;
+	} attrs[] = {
+		{ "fan_percent", &data->percent_fan },
+		{ "pump_percent", &data->percent_pump },
+		{ "led_logo", NULL, &data->led_logo },
+		{ "leds_ring", NULL, &data->leds_ring },
+		{ "leds_sync", NULL, &data->leds_sync },
+	};
+	ssize_t len = 0;
+	size_t i;
+
+	// not in the middle of applying a configuration
+	mutex_lock(&data->config.lock);
+	for (i = 0; i < ARRAY_SIZE(attrs); i++)
+		len += config_show_line(buf + len, PAGE_SIZE - len,
+		                        attrs[i].attr, attrs[i].percent,
+		                        attrs[i].led);
+	mutex_unlock(&data->config.lock);
+	return len;
+}
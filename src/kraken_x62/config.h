@@ -0,0 +1,55 @@
+#ifndef LEVIATHAN_X62_CONFIG_H_INCLUDED
+#define LEVIATHAN_X62_CONFIG_H_INCLUDED
+
+#include "led.h"
+
+#include <linux/device.h>
+#include <linux/mutex.h>
+
+struct usb_kraken;
+
+/**
+ * A configuration, validated and staged to be applied all at once.
+ * @set: the bits of the commands set by it
+ */
+struct config_staged {
+	unsigned long set;
+	unsigned int percent_fan;
+	unsigned int percent_pump;
+	struct led_batch led_logo;
+	struct led_batch leds_ring;
+	struct led_batch leds_sync;
+};
+
+struct config_data {
+	// held while applying a configuration, and by the updates while taking
+	// and sending the commands, so that an update sends all of one or none
+	// of it; also guards the staging
+	struct mutex lock;
+	// between `begin` and `commit`, the configuration staged so far
+	bool staging;
+	struct config_staged staged;
+};
+
+void config_data_init(struct config_data *data);
+
+/**
+ * Parse a write to attribute `config`: a configuration of lines `ATTRIBUTE
+ * VALUE`, applied at once unless staged, or `begin`, `commit` or `abort`.
+ * Returns -EINVAL if invalid, applying nothing.
+ */
+int config_data_parse(struct usb_kraken *kraken, struct device *dev,
+                      const char *buf);
+
+/**
+ * Print the current configuration, as read from attribute `config`.
+ */
+ssize_t config_data_show(struct usb_kraken *kraken, char *buf);
+
+/**
+ * Apply a staged configuration, to be sent by the next update as a whole.
+ */
+void config_apply(struct usb_kraken *kraken,
+                  const struct config_staged *staged);
+
+#endif  /* LEVIATHAN_X62_CONFIG_H_INCLUDED */
@@ -1,15 +1,33 @@
 #ifndef LEVIATHAN_X62_DRIVER_DATA_H_INCLUDED
 #define LEVIATHAN_X62_DRIVER_DATA_H_INCLUDED
 
+#include "config.h"
 #include "led.h"
 #include "percent.h"
 #include "status.h"
 
+#include <linux/usb.h>
+
 #define DATA_SERIAL_NUMBER_SIZE ((size_t) 65)
 
+/**
+ * The commands of the device, as bits in the kraken's dirty bitmap.
+ */
+enum kraken_x62_command {
+	COMMAND_PERCENT_FAN,
+	COMMAND_PERCENT_PUMP,
+	COMMAND_LED_LOGO,
+	COMMAND_LEDS_RING,
+	COMMAND_LEDS_SYNC,
+};
+
 struct kraken_driver_data {
 	char serial_number[DATA_SERIAL_NUMBER_SIZE];
 
+	// the interrupt endpoints all messages are sent to / received from
+	struct usb_endpoint_descriptor *endpoint_in;
+	struct usb_endpoint_descriptor *endpoint_out;
+
 	struct status_data status;
 
 	struct percent_data percent_fan;
@@ -18,6 +36,12 @@ struct kraken_driver_data {
 	struct led_data led_logo;
 	struct led_data leds_ring;
 	struct led_data leds_sync;
+
+	// the configuration applied all at once through attribute `config`
+	struct config_data config;
+
+	// the hwmon device, if registered
+	struct device *hwmon;
 };
 
 #endif  /* LEVIATHAN_X62_DRIVER_DATA_H_INCLUDED */
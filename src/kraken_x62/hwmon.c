@@ -0,0 +1,143 @@
+/* Registration with the hwmon subsystem.
+ */
+
+#include "hwmon.h"
+#include "driver_data.h"
+#include "../common.h"
+
+#include <linux/hwmon.h>
+#include <linux/kernel.h>
+#include <linux/usb.h>
+
+// otherwise, the header's stubs stand in for all of this
+#if IS_REACHABLE(CONFIG_HWMON)
+
+static const char *const FAN_LABELS[] = {
+	"fan", "pump",
+};
+
+static struct percent_data *
+kraken_x62_hwmon_percent(struct kraken_driver_data *data, int channel)
+{
+	return channel == 0 ? &data->percent_fan : &data->percent_pump;
+}
+
+static umode_t kraken_x62_hwmon_is_visible(const void *drvdata,
+                                           enum hwmon_sensor_types type,
+                                           u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_temp:
+		if (attr == hwmon_temp_input || attr == hwmon_temp_label)
+			return 0444;
+		break;
+	case hwmon_fan:
+		if (attr == hwmon_fan_input || attr == hwmon_fan_label)
+			return 0444;
+		break;
+	case hwmon_pwm:
+		if (attr == hwmon_pwm_input)
+			return 0644;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int kraken_x62_hwmon_read(struct device *dev,
+                                 enum hwmon_sensor_types type, u32 attr,
+                                 int channel, long *val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	struct kraken_driver_data *data = kraken->data;
+	struct status_msg msg;
+
+	switch (type) {
+	case hwmon_temp:
+		status_data_snapshot(&data->status, &msg);
+		// in m°C
+		*val = status_msg_temp_liquid(&msg) * 1000L;
+		return 0;
+	case hwmon_fan:
+		status_data_snapshot(&data->status, &msg);
+		*val = channel == 0 ? status_msg_fan_rpm(&msg)
+		                    : status_msg_pump_rpm(&msg);
+		return 0;
+	case hwmon_pwm:
+		*val = DIV_ROUND_CLOSEST(
+			percent_data_applied(
+				kraken_x62_hwmon_percent(data, channel)) * 255,
+			100);
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_x62_hwmon_read_string(struct device *dev,
+                                        enum hwmon_sensor_types type,
+                                        u32 attr, int channel,
+                                        const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		*str = "liquid";
+		return 0;
+	case hwmon_fan:
+		*str = FAN_LABELS[channel];
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_x62_hwmon_write(struct device *dev,
+                                  enum hwmon_sensor_types type, u32 attr,
+                                  int channel, long val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	if (type != hwmon_pwm || attr != hwmon_pwm_input)
+		return -EOPNOTSUPP;
+	if (val < 0 || val > 255)
+		return -EINVAL;
+	// clamped to the allowed range, as when written to the percent itself
+	percent_data_write(kraken_x62_hwmon_percent(kraken->data, channel),
+	                   DIV_ROUND_CLOSEST(val * 100, 255));
+	return 0;
+}
+
+static const struct hwmon_ops kraken_x62_hwmon_ops = {
+	.is_visible  = kraken_x62_hwmon_is_visible,
+	.read        = kraken_x62_hwmon_read,
+	.read_string = kraken_x62_hwmon_read_string,
+	.write       = kraken_x62_hwmon_write,
+};
+
+static const struct hwmon_channel_info *const kraken_x62_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(fan,
+	                   HWMON_F_INPUT | HWMON_F_LABEL,
+	                   HWMON_F_INPUT | HWMON_F_LABEL),
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT, HWMON_PWM_INPUT),
+	NULL,
+};
+
+static const struct hwmon_chip_info kraken_x62_hwmon_chip_info = {
+	.ops  = &kraken_x62_hwmon_ops,
+	.info = kraken_x62_hwmon_info,
+};
+
+struct device *kraken_x62_hwmon_register(struct usb_kraken *kraken)
+{
+	return hwmon_device_register_with_info(
+		&kraken->interface->dev, kraken_driver_name, kraken,
+		&kraken_x62_hwmon_chip_info, NULL);
+}
+
+void kraken_x62_hwmon_unregister(struct device *hwmon)
+{
+	hwmon_device_unregister(hwmon);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef LEVIATHAN_X62_HWMON_H_INCLUDED
+#define LEVIATHAN_X62_HWMON_H_INCLUDED
+
+#include "../common.h"
+
+#include <linux/device.h>
+#include <linux/kconfig.h>
+
+#if IS_REACHABLE(CONFIG_HWMON)
+
+/**
+ * Register the device with the hwmon subsystem: temp1 is the liquid, fan1 the
+ * fan, and fan2 the pump, with pwm1 and pwm2 their percents.  Return the hwmon
+ * device, or an ERR_PTR().
+ */
+struct device *kraken_x62_hwmon_register(struct usb_kraken *kraken);
+void kraken_x62_hwmon_unregister(struct device *hwmon);
+
+#else
+
+static inline struct device *
+kraken_x62_hwmon_register(struct usb_kraken *kraken)
+{
+	return NULL;
+}
+
+static inline void kraken_x62_hwmon_unregister(struct device *hwmon)
+{
+}
+
+#endif
+
+#endif  /* LEVIATHAN_X62_HWMON_H_INCLUDED */
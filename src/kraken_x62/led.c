@@ -4,7 +4,10 @@
 #include "led.h"
 #include "../util.h"
 
-#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/build_bug.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/usb.h>
 
@@ -330,32 +333,121 @@ static void led_batch_init(struct led_batch *batch, enum led_which which)
 	}
 }
 
-static int led_batch_update(struct led_batch *batch, struct usb_kraken *kraken)
+static void led_batch_urb_complete(struct urb *urb)
 {
-	int ret, sent;
+	struct led_data *data = urb->context;
+	unsigned long flags;
+	int ret = urb->status;
+	kraken_urb_complete(data->kraken, urb, KRAKEN_MSG_LED,
+	                    data->sending_submitted);
+	if (ret || urb->actual_length != urb->transfer_buffer_length) {
+		dev_err(&urb->dev->dev, "failed to set LED cycle: %d\n", ret);
+		kraken_urb_error(data->kraken, ret ? ret : -EIO);
+		data->sending_failed = true;
+	}
+	if (!atomic_dec_and_test(&data->sending_left))
+		return;
+	if (data->sending_failed) {
+		kraken_commands_resend(data->kraken, BIT(data->command));
+		return;
+	}
+
+	// all cycles have been sent
+	spin_lock_irqsave(&data->lock, flags);
+	memcpy(&data->prev, &data->sending, sizeof(data->prev));
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+static int led_batch_submit(struct led_data *data, struct usb_kraken *kraken)
+{
+	const u8 len = data->sending.len;
+	int ret;
 	u8 i;
-	for (i = 0; i < batch->len; i++) {
-		ret = usb_interrupt_msg(
-			kraken->udev, usb_sndctrlpipe(kraken->udev, 1),
-			batch->cycles[i].msg, sizeof(batch->cycles[i].msg),
-			&sent, 1000);
-		if (ret || sent != sizeof(batch->cycles[i].msg)) {
+	data->sending_failed = false;
+	data->sending_submitted = ktime_get();
+	atomic_set(&data->sending_left, len);
+	// all cycles are sent to the same endpoint, and thus arrive in order
+	for (i = 0; i < len; i++) {
+		struct urb *urb = data->urbs[i];
+		memcpy(urb->transfer_buffer, data->sending.cycles[i].msg,
+		       sizeof(data->sending.cycles[i].msg));
+		ret = kraken_urb_submit(kraken, urb, GFP_KERNEL);
+		if (ret) {
 			dev_err(&kraken->udev->dev,
 			        "failed to set LED cycle %u\n", i);
-			return ret ? ret : 1;
+			data->sending_failed = true;
+			smp_mb__before_atomic();
+			if (atomic_sub_and_test(len - i, &data->sending_left))
+				kraken_commands_resend(kraken,
+				                       BIT(data->command));
+			return ret;
 		}
 	}
+	kraken_command_frames_sent(kraken, len);
 	return 0;
 }
 
-void led_data_init(struct led_data *data, enum led_which which)
+int led_data_init(struct led_data *data, struct usb_kraken *kraken,
+                  const struct usb_endpoint_descriptor *endpoint,
+                  enum led_which which, unsigned int command)
 {
+	struct usb_device *udev = kraken->udev;
+	size_t i;
+	int ret;
+
 	led_batch_init(&data->batch, which);
 	// this will never be confused for a real batch
 	data->prev.len = 0;
-	data->update = false;
+	data->command = command;
+
+	data->kraken = kraken;
+	spin_lock_init(&data->lock);
 
-	mutex_init(&data->mutex);
+	for (i = 0; i < ARRAY_SIZE(data->urbs); i++) {
+		const size_t size = sizeof(data->batch.cycles[i].msg);
+		data->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (data->urbs[i] == NULL) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		usb_fill_int_urb(data->urbs[i], udev,
+		                 usb_sndintpipe(udev,
+		                                endpoint->bEndpointAddress),
+		                 NULL, 0, led_batch_urb_complete, data,
+		                 endpoint->bInterval);
+		ret = kraken_urb_buffer(kraken, data->urbs[i], size);
+		if (ret) {
+			usb_free_urb(data->urbs[i]);
+			goto error;
+		}
+	}
+	return 0;
+error:
+	while (i-- > 0)
+		usb_free_urb(data->urbs[i]);
+	return ret;
+}
+
+void led_data_free(struct led_data *data)
+{
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(data->urbs); i++)
+		usb_free_urb(data->urbs[i]);
+}
+
+void led_data_reset(struct led_data *data)
+{
+	unsigned long flags;
+	bool sent;
+
+	spin_lock_irqsave(&data->lock, flags);
+	sent = data->prev.len != 0;
+	// no batch sent is empty, so this never equals one
+	data->prev.len = 0;
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (sent)
+		kraken_commands_resend(data->kraken, BIT(data->command));
 }
 
 static int parse_preset_check_len(
@@ -630,51 +722,243 @@ static int parse_batch(struct led_batch *batch, struct device *dev,
 	return 0;
 }
 
-int led_data_parse(struct led_data *data, struct device *dev, const char *attr,
-                   const char *buf)
+int led_batch_parse(struct led_data *data, struct device *dev,
+                    const char *attr, const char *buf, struct led_batch *batch)
 {
+	unsigned long flags;
 	int ret;
 
-	mutex_lock(&data->mutex);
+	spin_lock_irqsave(&data->lock, flags);
+	memcpy(batch, &data->batch, sizeof(*batch));
+	spin_unlock_irqrestore(&data->lock, flags);
 
-	ret = parse_batch(&data->batch, dev, attr, &buf);
+	ret = parse_batch(batch, dev, attr, &buf);
 	if (ret)
-		goto error;
+		return ret;
 	if (buf[0] != '\0') {
 		dev_warn(dev, "%s: unrecognized data left in buffer: `%s'\n",
 		         attr, buf);
-		ret = 1;
-		goto error;
+		return 1;
 	}
+	return 0;
+}
 
-	data->update = true;
-	mutex_unlock(&data->mutex);
+int led_data_parse(struct led_data *data, struct device *dev, const char *attr,
+                   const char *buf)
+{
+	// parse into a copy, so that an invalid batch leaves no trace
+	struct led_batch batch;
+	int ret = led_batch_parse(data, dev, attr, buf, &batch);
+	if (ret)
+		return ret;
+
+	led_data_commit(data, &batch);
 	return 0;
+}
 
-error:
-	data->update = false;
-	mutex_unlock(&data->mutex);
-	return ret;
+static void led_color_from_leviathan(struct led_color *color,
+                                     const struct leviathan_color *from)
+{
+	color->red   = from->red;
+	color->green = from->green;
+	color->blue  = from->blue;
 }
 
-int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data)
+static void led_msg_colors_from_leviathan(
+	struct led_msg *msg, const struct leviathan_led_cycle *cycle)
 {
-	int ret = 0;
+	struct led_color logo;
+	struct led_color ring[LED_MSG_COLORS_RING];
+	size_t i;
 
-	mutex_lock(&data->mutex);
+	led_color_from_leviathan(&logo, &cycle->logo);
+	for (i = 0; i < ARRAY_SIZE(ring); i++)
+		led_color_from_leviathan(&ring[i], &cycle->ring[i]);
+	switch (led_msg_which_get(msg)) {
+	case LED_WHICH_LOGO:
+		led_msg_color_logo(msg, &logo);
+		break;
+	case LED_WHICH_RING:
+		led_msg_colors_ring(msg, ring);
+		break;
+	case LED_WHICH_SYNC:
+		led_msg_color_logo(msg, &logo);
+		led_msg_colors_ring(msg, ring);
+		break;
+	}
+}
 
-	if (!data->update)
-		goto error;
-	// if same message as previously, no update necessary
-	if (memcmp(&data->batch, &data->prev, sizeof(data->batch)) == 0)
-		goto error;
-	ret = led_batch_update(&data->batch, kraken);
-	if (ret)
-		goto error;
-	memcpy(&data->prev, &data->batch, sizeof(data->prev));
-	data->update = false;
+int led_data_prepare(struct led_data *data, struct device *dev,
+                     const char *attr, const struct leviathan_leds *leds,
+                     struct led_batch *batch)
+{
+	const enum led_preset preset = leds->preset;
+	const bool moving = leds->moving;
+	const enum led_direction direction = leds->direction;
+	const enum led_interval interval = leds->interval;
+	unsigned long flags;
+	u8 i;
 
-error:
-	mutex_unlock(&data->mutex);
-	return ret;
+	BUILD_BUG_ON(LEVIATHAN_LED_CYCLES != LED_BATCH_CYCLES_SIZE);
+	BUILD_BUG_ON(LEVIATHAN_LED_RING_COLORS != LED_MSG_COLORS_RING);
+	BUILD_BUG_ON(LEVIATHAN_LED_PRESET_LOAD != LED_PRESET_LOAD);
+
+	spin_lock_irqsave(&data->lock, flags);
+	memcpy(batch, &data->batch, sizeof(*batch));
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	// checked in the same order as parsed; the legality of the settings
+	// depends on the preset, which is thus set first
+	if (leds->cycles < 1 || leds->cycles > LED_BATCH_CYCLES_SIZE) {
+		dev_warn(dev, "%s: invalid cycles %u\n", attr, leds->cycles);
+		return -EINVAL;
+	}
+	batch->len = leds->cycles;
+	if (preset > LED_PRESET_LOAD ||
+	    !led_msg_preset_is_legal(&batch->cycles[0], preset)) {
+		dev_warn(dev, "%s: invalid preset %u\n", attr, leds->preset);
+		return -EINVAL;
+	}
+	if (parse_preset_check_len(preset, batch, dev, attr))
+		return -EINVAL;
+	for (i = 0; i < batch->len; i++)
+		led_msg_preset(&batch->cycles[i], preset);
+
+	if (leds->moving > 1 ||
+	    !led_msg_moving_is_legal(&batch->cycles[0], moving) ||
+	    direction > LED_DIRECTION_COUNTERCLOCKWISE ||
+	    !led_msg_direction_is_legal(&batch->cycles[0], direction) ||
+	    interval > LED_INTERVAL_FASTEST ||
+	    !led_msg_interval_is_legal(&batch->cycles[0], interval) ||
+	    leds->group_size < LED_GROUP_SIZE_MIN ||
+	    leds->group_size > LED_GROUP_SIZE_MAX ||
+	    !led_msg_group_size_is_legal(&batch->cycles[0],
+	                                 leds->group_size)) {
+		dev_warn(dev, "%s: invalid or illegal settings for preset %u\n",
+		         attr, leds->preset);
+		return -EINVAL;
+	}
+	for (i = 0; i < batch->len; i++) {
+		struct led_msg *msg = &batch->cycles[i];
+		led_msg_moving(msg, moving);
+		led_msg_direction(msg, direction);
+		led_msg_interval(msg, interval);
+		led_msg_group_size(msg, leds->group_size);
+		led_msg_colors_from_leviathan(msg, &leds->cycle[i]);
+	}
+	return 0;
+}
+
+void led_data_store(struct led_data *data, const struct led_batch *batch)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&data->lock, flags);
+	memcpy(&data->batch, batch, sizeof(data->batch));
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+void led_data_commit(struct led_data *data, const struct led_batch *batch)
+{
+	led_data_store(data, batch);
+	kraken_command_write(data->kraken, data->command);
+}
+
+static const char *const LED_PRESET_NAMES[] = {
+	[LED_PRESET_FIXED]            = "fixed",
+	[LED_PRESET_FADING]           = "fading",
+	[LED_PRESET_SPECTRUM_WAVE]    = "spectrum_wave",
+	[LED_PRESET_MARQUEE]          = "marquee",
+	[LED_PRESET_COVERING_MARQUEE] = "covering_marquee",
+	[LED_PRESET_ALTERNATING]      = "alternating",
+	[LED_PRESET_BREATHING]        = "breathing",
+	[LED_PRESET_PULSE]            = "pulse",
+	[LED_PRESET_TAI_CHI]          = "tai_chi",
+	[LED_PRESET_WATER_COOLER]     = "water_cooler",
+	[LED_PRESET_LOAD]             = "load",
+};
+
+static const char *const LED_INTERVAL_NAMES[] = {
+	[LED_INTERVAL_SLOWEST] = "slowest",
+	[LED_INTERVAL_SLOWER]  = "slower",
+	[LED_INTERVAL_NORMAL]  = "normal",
+	[LED_INTERVAL_FASTER]  = "faster",
+	[LED_INTERVAL_FASTEST] = "fastest",
+};
+
+/* Print the colors of a cycle's message, as parsed by parse_colors().
+ */
+static int led_msg_show_colors(const struct led_msg *msg, char *buf,
+                               size_t size)
+{
+	const enum led_which which = led_msg_which_get(msg);
+	int len = 0;
+	size_t i;
+
+	// the logo color is in GRB format
+	if (which == LED_WHICH_LOGO || which == LED_WHICH_SYNC)
+		len += scnprintf(buf + len, size - len, " %02x%02x%02x",
+		                 msg->msg[6], msg->msg[5], msg->msg[7]);
+	if (which == LED_WHICH_RING || which == LED_WHICH_SYNC) {
+		for (i = 0; i < LED_MSG_COLORS_RING; i++) {
+			const u8 *start = msg->msg + 8 + i * 3;
+			len += scnprintf(buf + len, size - len,
+			                 " %02x%02x%02x", start[0], start[1],
+			                 start[2]);
+		}
+	}
+	return len;
+}
+
+int led_data_show(struct led_data *data, char *buf, size_t size)
+{
+	struct led_batch batch;
+	const struct led_msg *msg = &batch.cycles[0];
+	unsigned long flags;
+	enum led_preset preset;
+	enum led_direction direction;
+	enum led_interval interval;
+	int len;
+	u8 i;
+
+	spin_lock_irqsave(&data->lock, flags);
+	memcpy(&batch, &data->batch, sizeof(batch));
+	spin_unlock_irqrestore(&data->lock, flags);
+	if (batch.len == 0)
+		return 0;
+
+	// all cycles share the settings, as parsed
+	preset = led_msg_preset_get(msg);
+	interval = msg->msg[4] & 0b111;
+	if (preset >= ARRAY_SIZE(LED_PRESET_NAMES) ||
+	    interval >= ARRAY_SIZE(LED_INTERVAL_NAMES))
+		return 0;
+	direction = (msg->msg[2] >> 4) & 0b1111;
+	len = scnprintf(buf, size, "%u %s %u %s %s %u", batch.len,
+	                LED_PRESET_NAMES[preset], (msg->msg[2] >> 3) & 0b1,
+	                direction == LED_DIRECTION_COUNTERCLOCKWISE
+	                ? "backward" : "forward",
+	                LED_INTERVAL_NAMES[interval],
+	                ((msg->msg[4] >> 3) & 0b11) + LED_GROUP_SIZE_MIN);
+	for (i = 0; i < batch.len; i++)
+		len += led_msg_show_colors(&batch.cycles[i], buf + len,
+		                           size - len);
+	return len;
+}
+
+int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data)
+{
+	unsigned long flags;
+	bool send;
+
+	spin_lock_irqsave(&data->lock, flags);
+	// if same message as previously, no update necessary
+	send = memcmp(&data->batch, &data->prev, sizeof(data->batch)) != 0;
+	// the completion handler does the bookkeeping once the batch is sent
+	if (send)
+		memcpy(&data->sending, &data->batch, sizeof(data->sending));
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (!send)
+		return 0;
+	return led_batch_submit(data, kraken);
 }
@@ -3,8 +3,11 @@
 
 #include "../common.h"
 
+#include <linux/atomic.h>
 #include <linux/device.h>
-#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
 
 #define LED_MSG_SIZE        ((size_t) 32)
 
@@ -32,15 +35,73 @@ struct led_batch {
 struct led_data {
 	struct led_batch batch;
 	struct led_batch prev;
-	bool update;
+	// the command bit marked when the batch is written
+	unsigned int command;
 
-	struct mutex mutex;
+	// the batch being sent, when it was submitted, and the nr of its cycles
+	// not yet completed
+	struct led_batch sending;
+	ktime_t sending_submitted;
+	atomic_t sending_left;
+	bool sending_failed;
+	// pre-allocated URBs sending each cycle, with DMA-coherent transfer
+	// buffers
+	struct urb *urbs[LED_BATCH_CYCLES_SIZE];
+	struct usb_kraken *kraken;
+
+	spinlock_t lock;
 };
 
-void led_data_init(struct led_data *data, enum led_which which);
+int led_data_init(struct led_data *data, struct usb_kraken *kraken,
+                  const struct usb_endpoint_descriptor *endpoint,
+                  enum led_which which, unsigned int command);
+void led_data_free(struct led_data *data);
 int led_data_parse(struct led_data *data, struct device *dev, const char *attr,
                    const char *buf);
 
+/**
+ * Parse LED settings as written to attribute attr into a batch to be stored or
+ * committed, leaving the LEDs untouched.  Returns non-zero if invalid, warning
+ * about why.
+ */
+int led_batch_parse(struct led_data *data, struct device *dev,
+                    const char *attr, const char *buf, struct led_batch *batch);
+
+/**
+ * Print the LED settings last written, in the format of the attributes and
+ * without a newline.  Returns 0, printing nothing, if none.
+ */
+int led_data_show(struct led_data *data, char *buf, size_t size);
+
+/**
+ * Validate binary LED settings of the character device, and make them into a
+ * batch to be committed.  Returns -EINVAL if invalid, warning about why as
+ * attribute attr would.
+ */
+int led_data_prepare(struct led_data *data, struct device *dev,
+                     const char *attr, const struct leviathan_leds *leds,
+                     struct led_batch *batch);
+
+/**
+ * Store a valid batch, without marking it to be sent.
+ */
+void led_data_store(struct led_data *data, const struct led_batch *batch);
+
+/**
+ * Write a valid batch, to be sent by the next update.
+ */
+void led_data_commit(struct led_data *data, const struct led_batch *batch);
+
+/**
+ * Forget the batch last sent, as the device has lost it, and mark it to be
+ * sent again if it had been sent at all.
+ */
+void led_data_reset(struct led_data *data);
+
+/**
+ * Send the batch if it has changed since last sent.  Called when the batch's
+ * command has been taken by an update.
+ */
 int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data);
 
 #endif  /* LEVIATHAN_X62_LED_H_INCLUDED */
@@ -1,46 +1,320 @@
 /* Driver for 1e71:170e devices.
  */
 
+#include "config.h"
 #include "driver_data.h"
+#include "hwmon.h"
 #include "led.h"
 #include "percent.h"
 #include "status.h"
 #include "../common.h"
+#include "../netlink.h"
+#include "../stats.h"
 #include "../util.h"
 
+#define CREATE_TRACE_POINTS
+#include "../trace.h"
+
 #include <asm/byteorder.h>
+#include <linux/bitops.h>
+#include <linux/build_bug.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
-#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/usb.h>
 
 #define DRIVER_NAME "kraken_x62"
 
-static void kraken_driver_data_init(struct kraken_driver_data *data)
+#define UPDATE_TIMEOUT_MS 1000
+
+// the transfer buffers of all URBs: status, percent, and all LED cycles
+#define BUFFERS_SIZE (KRAKEN_BUFFER_SIZE(STATUS_DATA_MSG_SIZE) + \
+                      2 * KRAKEN_BUFFER_SIZE(PERCENT_MSG_SIZE) + \
+                      3 * LED_BATCH_CYCLES_SIZE * \
+                      KRAKEN_BUFFER_SIZE(LED_MSG_SIZE))
+
+static int kraken_driver_data_init(struct kraken_driver_data *data,
+                                   struct usb_kraken *kraken)
 {
-	status_data_init(&data->status);
-	percent_data_init(&data->percent_fan, PERCENT_MSG_WHICH_FAN);
-	percent_data_init(&data->percent_pump, PERCENT_MSG_WHICH_PUMP);
-	led_data_init(&data->led_logo, LED_WHICH_LOGO);
-	led_data_init(&data->leds_ring, LED_WHICH_RING);
-	led_data_init(&data->leds_sync, LED_WHICH_SYNC);
+	const struct usb_endpoint_descriptor *in = data->endpoint_in;
+	const struct usb_endpoint_descriptor *out = data->endpoint_out;
+	int ret;
+	config_data_init(&data->config);
+	if ((ret = status_data_init(&data->status, kraken, in)))
+		goto error_status;
+	if ((ret = percent_data_init(&data->percent_fan, kraken, out,
+	                             PERCENT_MSG_WHICH_FAN,
+	                             COMMAND_PERCENT_FAN)))
+		goto error_percent_fan;
+	if ((ret = percent_data_init(&data->percent_pump, kraken, out,
+	                             PERCENT_MSG_WHICH_PUMP,
+	                             COMMAND_PERCENT_PUMP)))
+		goto error_percent_pump;
+	if ((ret = led_data_init(&data->led_logo, kraken, out, LED_WHICH_LOGO,
+	                         COMMAND_LED_LOGO)))
+		goto error_led_logo;
+	if ((ret = led_data_init(&data->leds_ring, kraken, out, LED_WHICH_RING,
+	                         COMMAND_LEDS_RING)))
+		goto error_leds_ring;
+	if ((ret = led_data_init(&data->leds_sync, kraken, out, LED_WHICH_SYNC,
+	                         COMMAND_LEDS_SYNC)))
+		goto error_leds_sync;
+
+	return 0;
+error_leds_sync:
+	led_data_free(&data->leds_ring);
+error_leds_ring:
+	led_data_free(&data->led_logo);
+error_led_logo:
+	percent_data_free(&data->percent_pump);
+error_percent_pump:
+	percent_data_free(&data->percent_fan);
+error_percent_fan:
+	status_data_free(&data->status);
+error_status:
+	return ret;
+}
+
+static void kraken_driver_data_free(struct kraken_driver_data *data)
+{
+	led_data_free(&data->leds_sync);
+	led_data_free(&data->leds_ring);
+	led_data_free(&data->led_logo);
+	percent_data_free(&data->percent_pump);
+	percent_data_free(&data->percent_fan);
+	status_data_free(&data->status);
 }
 
 int kraken_driver_update(struct usb_kraken *kraken)
 {
 	struct kraken_driver_data *data = kraken->data;
+	unsigned long commands;
+	int ret = 0;
+
+	// a configuration applied at once is taken and sent whole
+	mutex_lock(&data->config.lock);
+	commands = kraken_commands_take(kraken);
+	// nothing written since the last update: the status is received
+	// continuously, independently of the updates, so there's nothing to do
+	if (commands == 0) {
+		mutex_unlock(&data->config.lock);
+		return 0;
+	}
 
+	// submit all messages back-to-back, then wait for the whole burst
+	if ((commands & BIT(COMMAND_PERCENT_FAN) &&
+	     (ret = kraken_x62_update_percent(kraken, &data->percent_fan))) ||
+	    (commands & BIT(COMMAND_PERCENT_PUMP) &&
+	     (ret = kraken_x62_update_percent(kraken, &data->percent_pump))) ||
+	    (commands & BIT(COMMAND_LED_LOGO) &&
+	     (ret = kraken_x62_update_led(kraken, &data->led_logo))) ||
+	    (commands & BIT(COMMAND_LEDS_RING) &&
+	     (ret = kraken_x62_update_led(kraken, &data->leds_ring))) ||
+	    (commands & BIT(COMMAND_LEDS_SYNC) &&
+	     (ret = kraken_x62_update_led(kraken, &data->leds_sync)))) {
+		// anything already sent won't be sent again, as it's unchanged
+		kraken_urb_error(kraken, ret);
+		kraken_commands_resend(kraken, commands);
+	}
+	mutex_unlock(&data->config.lock);
+	return kraken_urbs_wait(kraken, UPDATE_TIMEOUT_MS);
+}
+
+int kraken_driver_calibrate(struct usb_kraken *kraken)
+{
 	int ret;
-	if ((ret = kraken_x62_update_status(kraken, &data->status)) ||
-	    (ret = kraken_x62_update_percent(kraken, &data->percent_fan)) ||
-	    (ret = kraken_x62_update_percent(kraken, &data->percent_pump)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->led_logo)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->leds_ring)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->leds_sync)))
+	// the status is received continuously and updates send only what's
+	// been written, so a standard GET_STATUS control transfer stands in for
+	// an update's round trip
+	u8 *data = kmalloc(2, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+	ret = usb_control_msg(
+		kraken->udev, usb_rcvctrlpipe(kraken->udev, 0),
+		USB_REQ_GET_STATUS, USB_DIR_IN, 0, 0, data, 2,
+		UPDATE_TIMEOUT_MS);
+	kfree(data);
+	if (ret < 0)
 		return ret;
+	return ret == 2 ? 0 : -EIO;
+}
+
+void kraken_driver_suspend(struct usb_kraken *kraken)
+{
+	struct kraken_driver_data *data = kraken->data;
+	status_data_stop(&data->status);
+}
+
+int kraken_driver_resume(struct usb_kraken *kraken, bool reset)
+{
+	struct kraken_driver_data *data = kraken->data;
+	if (reset) {
+		percent_data_reset(&data->percent_fan);
+		percent_data_reset(&data->percent_pump);
+		led_data_reset(&data->led_logo);
+		led_data_reset(&data->leds_ring);
+		led_data_reset(&data->leds_sync);
+	}
+	return status_data_start(&data->status, GFP_NOIO);
+}
+
+void kraken_driver_readings(struct usb_kraken *kraken,
+                            struct kraken_readings *readings)
+{
+	struct kraken_driver_data *data = kraken->data;
+	struct status_msg msg;
+	status_data_snapshot(&data->status, &msg);
+	readings->temp_liquid = status_msg_temp_liquid(&msg);
+	readings->fan_rpm = status_msg_fan_rpm(&msg);
+	readings->pump_rpm = status_msg_pump_rpm(&msg);
+}
+
+void kraken_driver_telemetry(struct usb_kraken *kraken,
+                             struct leviathan_telemetry *telemetry)
+{
+	struct kraken_driver_data *data = kraken->data;
+	struct status_msg msg;
+	BUILD_BUG_ON(sizeof(msg.msg) > sizeof(telemetry->frame));
+
+	status_data_snapshot(&data->status, &msg);
+	telemetry->sequence = msg.sequence;
+	telemetry->timestamp_ns = ktime_to_ns(msg.received);
+	telemetry->fan_rpm = status_msg_fan_rpm(&msg);
+	telemetry->pump_rpm = status_msg_pump_rpm(&msg);
+	telemetry->temp_liquid = status_msg_temp_liquid(&msg);
+	telemetry->fan_percent = percent_data_applied(&data->percent_fan);
+	telemetry->pump_percent = percent_data_applied(&data->percent_pump);
+	telemetry->unknown_1 = status_msg_unknown_1(&msg);
+	telemetry->unknown_2 = status_msg_unknown_2(&msg);
+	telemetry->unknown_3 = status_msg_unknown_3(&msg);
+	telemetry->frame_size = sizeof(msg.msg);
+	memcpy(telemetry->frame, msg.msg, sizeof(msg.msg));
+}
+
+const char *kraken_driver_serial(struct usb_kraken *kraken)
+{
+	return kraken->data->serial_number;
+}
+
+static struct percent_data *kraken_x62_percent(struct usb_kraken *kraken,
+                                               enum kraken_percent which)
+{
+	struct kraken_driver_data *data = kraken->data;
+	return which == KRAKEN_PERCENT_FAN ? &data->percent_fan
+	                                   : &data->percent_pump;
+}
+
+int kraken_driver_percent_write(struct usb_kraken *kraken,
+                                enum kraken_percent which, unsigned int percent)
+{
+	struct percent_data *data = kraken_x62_percent(kraken, which);
+	// rejected rather than clamped, as by driver kraken
+	if (percent < data->percent_min || percent > data->percent_max)
+		return -EINVAL;
+	percent_data_write(data, percent);
+	return 0;
+}
+
+void kraken_driver_percent_bounds(struct usb_kraken *kraken,
+                                  enum kraken_percent which, u8 *min, u8 *max)
+{
+	const struct percent_data *percent = kraken_x62_percent(kraken, which);
+	*min = percent->percent_min;
+	*max = percent->percent_max;
+}
+
+void kraken_driver_percents_control(struct usb_kraken *kraken,
+                                    const int percents[KRAKEN_PERCENTS])
+{
+	unsigned int which;
+	for (which = 0; which < KRAKEN_PERCENTS; which++) {
+		if (percents[which] >= 0)
+			percent_data_control(kraken_x62_percent(kraken, which),
+			                     percents[which]);
+	}
+}
+
+/* Validate the LED settings of a batch, staging them.
+ */
+static int kraken_x62_batch_leds(struct usb_kraken *kraken,
+                                 const struct leviathan_batch *batch,
+                                 struct config_staged *staged)
+{
+	struct kraken_driver_data *data = kraken->data;
+	const struct {
+		u32 bit;
+		unsigned int command;
+		struct led_data *data;
+		const struct leviathan_leds *leds;
+		struct led_batch *staged;
+		const char *attr;
+	} leds[] = {
+		{ LEVIATHAN_BATCH_LED_LOGO, COMMAND_LED_LOGO, &data->led_logo,
+		  &batch->led_logo, &staged->led_logo, "led_logo" },
+		{ LEVIATHAN_BATCH_LEDS_RING, COMMAND_LEDS_RING,
+		  &data->leds_ring, &batch->leds_ring, &staged->leds_ring,
+		  "leds_ring" },
+		{ LEVIATHAN_BATCH_LEDS_SYNC, COMMAND_LEDS_SYNC,
+		  &data->leds_sync, &batch->leds_sync, &staged->leds_sync,
+		  "leds_sync" },
+	};
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(leds); i++) {
+		if (!(batch->set & leds[i].bit))
+			continue;
+		ret = led_data_prepare(leds[i].data, &kraken->interface->dev,
+		                       leds[i].attr, leds[i].leds,
+		                       leds[i].staged);
+		if (ret)
+			return ret;
+		staged->set |= BIT(leds[i].command);
+	}
 	return 0;
 }
 
+int kraken_driver_batch(struct usb_kraken *kraken,
+                        const struct leviathan_batch *batch)
+{
+	struct kraken_driver_data *data = kraken->data;
+	struct config_staged *staged;
+	int ret;
+
+	staged = kzalloc(sizeof(*staged), GFP_KERNEL);
+	if (staged == NULL)
+		return -ENOMEM;
+	// validate all settings before writing anything; the percents are
+	// rejected if out of range, like kraken_driver_percent_write()
+	ret = -EINVAL;
+	if ((batch->set & LEVIATHAN_BATCH_FAN_PERCENT &&
+	     (batch->fan_percent < data->percent_fan.percent_min ||
+	      batch->fan_percent > data->percent_fan.percent_max)) ||
+	    (batch->set & LEVIATHAN_BATCH_PUMP_PERCENT &&
+	     (batch->pump_percent < data->percent_pump.percent_min ||
+	      batch->pump_percent > data->percent_pump.percent_max)))
+		goto out;
+	ret = kraken_x62_batch_leds(kraken, batch, staged);
+	if (ret)
+		goto out;
+	if (batch->set & LEVIATHAN_BATCH_FAN_PERCENT) {
+		staged->percent_fan = batch->fan_percent;
+		staged->set |= BIT(COMMAND_PERCENT_FAN);
+	}
+	if (batch->set & LEVIATHAN_BATCH_PUMP_PERCENT) {
+		staged->percent_pump = batch->pump_percent;
+		staged->set |= BIT(COMMAND_PERCENT_PUMP);
+	}
+	// all sent by the same update
+	config_apply(kraken, staged);
+out:
+	kfree(staged);
+	return ret;
+}
+
 static ssize_t serial_no_show(struct device *dev, struct device_attribute *attr,
                               char *buf)
 {
@@ -54,9 +328,9 @@ static ssize_t temp_liquid_show(struct device *dev,
                                 struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE,
-	                 "%u\n", status_data_temp_liquid(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_temp_liquid(&msg));
 }
 
 static DEVICE_ATTR_RO(temp_liquid);
@@ -65,8 +339,9 @@ static ssize_t fan_rpm_show(struct device *dev, struct device_attribute *attr,
                             char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE, "%u\n", status_data_fan_rpm(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_fan_rpm(&msg));
 }
 
 static DEVICE_ATTR_RO(fan_rpm);
@@ -75,8 +350,9 @@ static ssize_t pump_rpm_show(struct device *dev, struct device_attribute *attr,
                              char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE, "%u\n", status_data_pump_rpm(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_pump_rpm(&msg));
 }
 
 static DEVICE_ATTR_RO(pump_rpm);
@@ -85,8 +361,9 @@ static ssize_t unknown_1_show(struct device *dev, struct device_attribute *attr,
                               char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE, "%u\n", status_data_unknown_1(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_unknown_1(&msg));
 }
 
 static DEVICE_ATTR_RO(unknown_1);
@@ -95,8 +372,9 @@ static ssize_t unknown_2_show(struct device *dev, struct device_attribute *attr,
                               char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE, "%u\n", status_data_unknown_2(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_unknown_2(&msg));
 }
 
 static DEVICE_ATTR_RO(unknown_2);
@@ -105,8 +383,9 @@ static ssize_t unknown_3_show(struct device *dev, struct device_attribute *attr,
                               char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct status_data *status = &kraken->data->status;
-	return scnprintf(buf, PAGE_SIZE, "%u\n", status_data_unknown_3(status));
+	struct status_msg msg;
+	status_data_snapshot(&kraken->data->status, &msg);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status_msg_unknown_3(&msg));
 }
 
 static DEVICE_ATTR_RO(unknown_3);
@@ -143,6 +422,71 @@ static ssize_t pump_percent_store(struct device *dev,
 
 static DEVICE_ATTR_WO(pump_percent);
 
+static ssize_t attr_percent_limits_show(struct percent_data *data, char *buf)
+{
+	return percent_data_show_limits(data, buf);
+}
+
+static ssize_t attr_percent_limits_store(struct percent_data *data,
+                                         struct device *dev,
+                                         struct device_attribute *attr,
+                                         const char *buf, size_t count)
+{
+	int ret = percent_data_parse_limits(data, dev, attr->attr.name, buf);
+	if (ret)
+		return ret;
+	return count;
+}
+
+static ssize_t fan_percent_limits_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_percent_limits_show(&kraken->data->percent_fan, buf);
+}
+
+static ssize_t fan_percent_limits_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_percent_limits_store(&kraken->data->percent_fan, dev, attr,
+	                                 buf, count);
+}
+
+static DEVICE_ATTR_RW(fan_percent_limits);
+
+static ssize_t pump_percent_limits_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_percent_limits_show(&kraken->data->percent_pump, buf);
+}
+
+static ssize_t pump_percent_limits_store(struct device *dev,
+                                         struct device_attribute *attr,
+                                         const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return attr_percent_limits_store(&kraken->data->percent_pump, dev,
+	                                 attr, buf, count);
+}
+
+static DEVICE_ATTR_RW(pump_percent_limits);
+
+static ssize_t frames_suppressed_show(struct device *dev,
+                                      struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%lu\n",
+	                 percent_data_suppressed(&kraken->data->percent_fan) +
+	                 percent_data_suppressed(&kraken->data->percent_pump));
+}
+
+static DEVICE_ATTR_RO(frames_suppressed);
+
 static ssize_t attr_led_store(struct led_data *data, struct device *dev,
                               struct device_attribute *attr, const char *buf,
                               size_t count)
@@ -182,6 +526,25 @@ static ssize_t leds_sync_store(struct device *dev,
 
 static DEVICE_ATTR_WO(leds_sync);
 
+static ssize_t config_show(struct device *dev, struct device_attribute *attr,
+                           char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return config_data_show(kraken, buf);
+}
+
+static ssize_t config_store(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	int ret = config_data_parse(kraken, dev, buf);
+	if (ret)
+		return ret;
+	return count;
+}
+
+static DEVICE_ATTR_RW(config);
+
 int kraken_driver_create_device_files(struct usb_interface *interface)
 {
 	int ret;
@@ -203,19 +566,38 @@ int kraken_driver_create_device_files(struct usb_interface *interface)
 		goto error_fan_percent;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_pump_percent)))
 		goto error_pump_percent;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_fan_percent_limits)))
+		goto error_fan_percent_limits;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_pump_percent_limits)))
+		goto error_pump_percent_limits;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_frames_suppressed)))
+		goto error_frames_suppressed;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_led_logo)))
 		goto error_led_logo;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_leds_ring)))
 		goto error_leds_ring;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_leds_sync)))
 		goto error_leds_sync;
+	if ((ret = device_create_file(&interface->dev, &dev_attr_config)))
+		goto error_config;
 
 	return 0;
+error_config:
+	device_remove_file(&interface->dev, &dev_attr_leds_sync);
 error_leds_sync:
 	device_remove_file(&interface->dev, &dev_attr_leds_ring);
 error_leds_ring:
 	device_remove_file(&interface->dev, &dev_attr_led_logo);
 error_led_logo:
+	device_remove_file(&interface->dev, &dev_attr_frames_suppressed);
+error_frames_suppressed:
+	device_remove_file(&interface->dev, &dev_attr_pump_percent_limits);
+error_pump_percent_limits:
+	device_remove_file(&interface->dev, &dev_attr_fan_percent_limits);
+error_fan_percent_limits:
 	device_remove_file(&interface->dev, &dev_attr_pump_percent);
 error_pump_percent:
 	device_remove_file(&interface->dev, &dev_attr_fan_percent);
@@ -239,9 +621,13 @@ error_serial_no:
 
 void kraken_driver_remove_device_files(struct usb_interface *interface)
 {
+	device_remove_file(&interface->dev, &dev_attr_config);
 	device_remove_file(&interface->dev, &dev_attr_leds_sync);
 	device_remove_file(&interface->dev, &dev_attr_leds_ring);
 	device_remove_file(&interface->dev, &dev_attr_led_logo);
+	device_remove_file(&interface->dev, &dev_attr_frames_suppressed);
+	device_remove_file(&interface->dev, &dev_attr_pump_percent_limits);
+	device_remove_file(&interface->dev, &dev_attr_fan_percent_limits);
 	device_remove_file(&interface->dev, &dev_attr_pump_percent);
 	device_remove_file(&interface->dev, &dev_attr_fan_percent);
 	device_remove_file(&interface->dev, &dev_attr_unknown_3);
@@ -260,12 +646,13 @@ static int kraken_x62_initialize(struct usb_kraken *kraken,
 	u8 i;
 	int ret = -ENOMEM;
 	// NOTE: the data buffer of usb_*_msg() must be DMA capable, so data
-	// cannot be stack allocated.
+	// cannot be stack allocated.  Any kmalloc()ed buffer is DMA capable, so
+	// the scarce ZONE_DMA is not needed.
 	//
 	// Space for length byte, type-of-data byte, and serial number encoded
 	// UTF-16.
 	const size_t data_size = 2 + (DATA_SERIAL_NUMBER_SIZE - 1) * 2;
-	u8 *data = kmalloc(data_size, GFP_KERNEL | GFP_DMA);
+	u8 *data = kmalloc(data_size, GFP_KERNEL);
 	if (data == NULL)
 		goto error_data;
 
@@ -322,12 +709,26 @@ int kraken_driver_probe(struct usb_interface *interface,
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 
 	int ret = -ENOMEM;
-	kraken->data = kzalloc(sizeof(*kraken->data), GFP_KERNEL | GFP_DMA);
+	kraken->data = kzalloc(sizeof(*kraken->data), GFP_KERNEL);
 	if (kraken->data == NULL)
 		goto error_data;
 	data = kraken->data;
 
-	kraken_driver_data_init(data);
+	ret = usb_find_common_endpoints(interface->cur_altsetting, NULL, NULL,
+	                                &data->endpoint_in,
+	                                &data->endpoint_out);
+	if (ret) {
+		dev_err(&interface->dev, "missing interrupt endpoints: %d\n",
+		        ret);
+		goto error_endpoints;
+	}
+
+	ret = kraken_buffers_alloc(kraken, BUFFERS_SIZE);
+	if (ret)
+		goto error_buffers;
+	ret = kraken_driver_data_init(data, kraken);
+	if (ret)
+		goto error_data_init;
 
 	ret = kraken_x62_initialize(kraken, data->serial_number);
 	if (ret) {
@@ -335,10 +736,32 @@ int kraken_driver_probe(struct usb_interface *interface,
 		goto error_init_message;
 	}
 
+	ret = status_data_start(&data->status, GFP_KERNEL);
+	if (ret) {
+		dev_err(&interface->dev, "failed to start status updates: %d\n",
+		        ret);
+		goto error_status_start;
+	}
+
+	data->hwmon = kraken_x62_hwmon_register(kraken);
+	if (IS_ERR(data->hwmon)) {
+		ret = PTR_ERR(data->hwmon);
+		dev_err(&interface->dev, "failed to register hwmon: %d\n", ret);
+		goto error_hwmon;
+	}
+
 	dev_info(&interface->dev, "device connected\n");
 
 	return 0;
+error_hwmon:
+	status_data_stop(&data->status);
+error_status_start:
 error_init_message:
+	kraken_driver_data_free(data);
+error_data_init:
+	kraken_buffers_free(kraken);
+error_buffers:
+error_endpoints:
 	kfree(data);
 error_data:
 	return ret;
@@ -349,6 +772,11 @@ void kraken_driver_disconnect(struct usb_interface *interface)
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	struct kraken_driver_data *data = kraken->data;
 
+	if (data->hwmon)
+		kraken_x62_hwmon_unregister(data->hwmon);
+	status_data_stop(&data->status);
+	kraken_driver_data_free(data);
+	kraken_buffers_free(kraken);
 	kfree(data);
 
 	dev_info(&interface->dev, "device disconnected\n");
@@ -362,15 +790,42 @@ static const struct usb_device_id kraken_x62_id_table[] = {
 MODULE_DEVICE_TABLE(usb, kraken_x62_id_table);
 
 static struct usb_driver kraken_x62_driver = {
-	.name       = DRIVER_NAME,
-	.probe      = kraken_probe,
-	.disconnect = kraken_disconnect,
-	.id_table   = kraken_x62_id_table,
+	.name                 = DRIVER_NAME,
+	.probe                = kraken_probe,
+	.disconnect           = kraken_disconnect,
+	.suspend              = kraken_suspend,
+	.resume               = kraken_resume,
+	.reset_resume         = kraken_reset_resume,
+	.id_table             = kraken_x62_id_table,
+	.supports_autosuspend = 1,
 };
 
 const char *kraken_driver_name = DRIVER_NAME;
+struct usb_driver *const kraken_usb_driver = &kraken_x62_driver;
+
+static int __init kraken_x62_init(void)
+{
+	int ret = kraken_netlink_init();
+	if (ret)
+		return ret;
+	kraken_stats_init();
+	ret = usb_register(&kraken_x62_driver);
+	if (ret) {
+		kraken_stats_exit();
+		kraken_netlink_exit();
+	}
+	return ret;
+}
+
+static void __exit kraken_x62_exit(void)
+{
+	usb_deregister(&kraken_x62_driver);
+	kraken_stats_exit();
+	kraken_netlink_exit();
+}
 
-module_usb_driver(kraken_x62_driver);
+module_init(kraken_x62_init);
+module_exit(kraken_x62_exit);
 
 MODULE_DESCRIPTION("driver for 1e71:170e devices (NZXT Kraken X62)");
 MODULE_LICENSE("GPL");
@@ -5,6 +5,14 @@
 #include "../common.h"
 #include "../util.h"
 
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/usb.h>
+
 static const u8 PERCENT_MSG_HEADER[] = {
 	0x02, 0x4d,
 };
@@ -26,19 +34,24 @@ static void percent_msg_set(struct percent_msg *msg, u8 percent)
 	msg->msg[4] = percent;
 }
 
-static int percent_msg_update(struct percent_msg *msg,
-                              struct usb_kraken *kraken)
+static void percent_msg_urb_complete(struct urb *urb)
 {
-	int sent;
-	int ret = usb_interrupt_msg(
-		kraken->udev, usb_sndctrlpipe(kraken->udev, 1),
-		msg->msg, sizeof(msg->msg), &sent, 1000);
-	if (ret || sent != sizeof(msg->msg)) {
-		dev_err(&kraken->udev->dev,
+	struct percent_data *data = urb->context;
+	unsigned long flags;
+	int ret = urb->status;
+	// stamped by the update when submitted
+	kraken_urb_complete(data->kraken, urb, KRAKEN_MSG_PERCENT, data->sent);
+	if (ret || urb->actual_length != urb->transfer_buffer_length) {
+		dev_err(&urb->dev->dev,
 		        "failed to set speed percent: I/O error\n");
-		return ret ? ret : 1;
+		kraken_urb_error(data->kraken, ret ? ret : -EIO);
+		kraken_commands_resend(data->kraken, BIT(data->command));
+		return;
 	}
-	return 0;
+
+	spin_lock_irqsave(&data->lock, flags);
+	data->prev = percent_msg_get(urb->transfer_buffer);
+	spin_unlock_irqrestore(&data->lock, flags);
 }
 
 static void percent_data_set(struct percent_data *data, u8 percent)
@@ -46,8 +59,13 @@ static void percent_data_set(struct percent_data *data, u8 percent)
 	percent_msg_set(&data->msg, percent);
 }
 
-void percent_data_init(struct percent_data *data, enum percent_msg_which which)
+int percent_data_init(struct percent_data *data, struct usb_kraken *kraken,
+                      const struct usb_endpoint_descriptor *endpoint,
+                      enum percent_msg_which which, unsigned int command)
 {
+	struct usb_device *udev = kraken->udev;
+	int ret;
+
 	switch (which) {
 	case PERCENT_MSG_WHICH_FAN:
 		data->percent_min = 35;
@@ -62,77 +80,264 @@ void percent_data_init(struct percent_data *data, enum percent_msg_which which)
 	percent_msg_init(&data->msg, which);
 	// this will never be confused for a real percentage
 	data->prev = U8_MAX;
-	data->update = false;
+	data->deadband = 0;
+	data->slew_rate = 0;
+	data->slewing = false;
+	data->limited_at = ktime_set(0, 0);
+	data->suppressed = 0;
+	data->command = command;
+
+	data->kraken = kraken;
+	spin_lock_init(&data->lock);
 
-	mutex_init(&data->mutex);
+	data->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (data->urb == NULL)
+		return -ENOMEM;
+	usb_fill_int_urb(data->urb, udev,
+	                 usb_sndintpipe(udev, endpoint->bEndpointAddress),
+	                 NULL, 0, percent_msg_urb_complete, data,
+	                 endpoint->bInterval);
+	ret = kraken_urb_buffer(kraken, data->urb, sizeof(data->msg.msg));
+	if (ret)
+		usb_free_urb(data->urb);
+	return ret;
 }
 
-int percent_data_parse(struct percent_data *data, struct device *dev,
-                       const char *attr, const char *buf)
+void percent_data_free(struct percent_data *data)
 {
-	char percent_str[WORD_LEN_MAX];
-	unsigned int percent_ui;
+	usb_free_urb(data->urb);
+}
+
+u8 percent_data_applied(struct percent_data *data)
+{
+	unsigned long flags;
+	u8 applied;
+	spin_lock_irqsave(&data->lock, flags);
+	applied = data->prev == U8_MAX ? 0 : data->prev;
+	spin_unlock_irqrestore(&data->lock, flags);
+	return applied;
+}
+
+void percent_data_reset(struct percent_data *data)
+{
+	unsigned long flags;
+	bool sent;
+
+	spin_lock_irqsave(&data->lock, flags);
+	sent = data->prev != U8_MAX;
+	data->prev = U8_MAX;
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (sent)
+		kraken_commands_resend(data->kraken, BIT(data->command));
+}
+
+void percent_data_store(struct percent_data *data, unsigned int percent_ui)
+{
+	unsigned long flags;
 	u8 percent;
 
+	spin_lock_irqsave(&data->lock, flags);
+
+	if (percent_ui < data->percent_min) {
+		percent = data->percent_min;
+	} else if (percent_ui > data->percent_max) {
+		percent = data->percent_max;
+	} else {
+		percent = percent_ui;
+	}
+	percent_data_set(data, percent);
+
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+void percent_data_write(struct percent_data *data, unsigned int percent_ui)
+{
+	percent_data_store(data, percent_ui);
+	kraken_command_write(data->kraken, data->command);
+}
+
+void percent_data_control(struct percent_data *data, unsigned int percent_ui)
+{
+	percent_data_store(data, percent_ui);
+	// only sent if changed, like any write
+	kraken_commands_resend(data->kraken, BIT(data->command));
+}
+
+u8 percent_data_written(struct percent_data *data)
+{
+	unsigned long flags;
+	u8 percent;
+	spin_lock_irqsave(&data->lock, flags);
+	percent = percent_msg_get(&data->msg);
+	spin_unlock_irqrestore(&data->lock, flags);
+	return percent;
+}
+
+int percent_parse(struct device *dev, const char *attr, const char *buf,
+                  unsigned int *percent_ui)
+{
+	char percent_str[WORD_LEN_MAX];
+
 	int ret = str_scan_word(&buf, percent_str);
 	if (ret) {
 		dev_warn(dev, "%s: missing percent\n", attr);
-		goto error;
+		return ret;
 	}
-	ret = kstrtouint(percent_str, 0, &percent_ui);
+	ret = kstrtouint(percent_str, 0, percent_ui);
 	if (ret) {
 		dev_warn(dev, "%s: invalid percent %s\n", attr, percent_str);
-		goto error;
+		return ret;
 	}
 	if (buf[0] != '\0') {
 		dev_warn(dev, "%s: unrecognized data left in buffer: `%s'\n",
 		         attr, buf);
-		ret = 1;
-		goto error;
+		return 1;
 	}
+	return 0;
+}
 
-	mutex_lock(&data->mutex);
+int percent_data_parse(struct percent_data *data, struct device *dev,
+                       const char *attr, const char *buf)
+{
+	unsigned int percent_ui;
+	int ret = percent_parse(dev, attr, buf, &percent_ui);
+	if (ret)
+		return ret;
 
-	if (percent_ui < data->percent_min) {
-		percent = data->percent_min;
-	} else if (percent_ui > data->percent_max) {
-		percent = data->percent_max;
-	} else {
-		percent = percent_ui;
+	percent_data_write(data, percent_ui);
+	return 0;
+}
+
+int percent_data_parse_limits(struct percent_data *data, struct device *dev,
+                              const char *attr, const char *buf)
+{
+	char word[WORD_LEN_MAX];
+	unsigned long flags;
+	u8 deadband, slew_rate;
+
+	if (str_scan_word(&buf, word) || kstrtou8(word, 0, &deadband) ||
+	    deadband > 100) {
+		dev_warn(dev, "%s: invalid deadband %s\n", attr, word);
+		return -EINVAL;
+	}
+	if (str_scan_word(&buf, word) || kstrtou8(word, 0, &slew_rate) ||
+	    slew_rate > 100) {
+		dev_warn(dev, "%s: invalid slew rate %s\n", attr, word);
+		return -EINVAL;
+	}
+	if (buf[0] != '\0') {
+		dev_warn(dev, "%s: unrecognized data left in buffer: `%s'\n",
+		         attr, buf);
+		return -EINVAL;
 	}
-	percent_data_set(data, percent);
 
-	data->update = true;
-	mutex_unlock(&data->mutex);
+	spin_lock_irqsave(&data->lock, flags);
+	data->deadband = deadband;
+	data->slew_rate = slew_rate;
+	spin_unlock_irqrestore(&data->lock, flags);
 	return 0;
+}
 
-error:
-	mutex_lock(&data->mutex);
-	data->update = false;
-	mutex_unlock(&data->mutex);
-	return ret;
+ssize_t percent_data_show_limits(struct percent_data *data, char *buf)
+{
+	unsigned long flags;
+	u8 deadband, slew_rate;
+	spin_lock_irqsave(&data->lock, flags);
+	deadband = data->deadband;
+	slew_rate = data->slew_rate;
+	spin_unlock_irqrestore(&data->lock, flags);
+	return scnprintf(buf, PAGE_SIZE, "%u %u\n", deadband, slew_rate);
+}
+
+unsigned long percent_data_suppressed(struct percent_data *data)
+{
+	unsigned long flags, suppressed;
+	spin_lock_irqsave(&data->lock, flags);
+	suppressed = data->suppressed;
+	spin_unlock_irqrestore(&data->lock, flags);
+	return suppressed;
+}
+
+/* The percent to send now towards the one written, within the deadband and
+ * slew rate.  Called with the lock held.
+ */
+static u8 percent_data_limit(struct percent_data *data, ktime_t now)
+{
+	const u8 percent = percent_msg_get(&data->msg);
+	const bool slewing = data->slewing;
+	const ktime_t interval = data->kraken->update_interval;
+	ktime_t from = data->limited_at;
+	unsigned int diff;
+	s64 step;
+
+	data->slewing = false;
+	// nothing sent to limit the change from, or no change
+	if (data->prev == U8_MAX || percent == data->prev)
+		goto steady;
+	diff = abs((int) percent - (int) data->prev);
+
+	// a small change isn't worth a frame, unless to either bound; nor is
+	// the deadband applied again while slewing, which would stop it short
+	if (diff <= data->deadband && !slewing &&
+	    percent != data->percent_min && percent != data->percent_max) {
+		data->suppressed++;
+		data->limited_at = now;
+		return data->prev;
+	}
+	if (data->slew_rate == 0)
+		goto steady;
+
+	// the step allowed grows with the time since the last step, so that
+	// slow rates still move at fast update intervals.  The first step
+	// after a steady period counts at most an update's worth of time.
+	if (!slewing && ktime_compare(interval, ktime_set(0, 0)) != 0 &&
+	    ktime_compare(ktime_sub(now, from), interval) > 0)
+		from = ktime_sub(now, interval);
+	step = div_s64((s64) data->slew_rate * ktime_ms_delta(now, from), 1000);
+	if (step >= diff)
+		goto steady;
+	data->slewing = true;
+	// only the time the step took is used up, so that the remainder adds
+	// up over the updates even when a single one allows less than 1 %
+	data->limited_at = ktime_add_ms(from,
+	                                div_s64(step * 1000, data->slew_rate));
+	if (step == 0) {
+		data->suppressed++;
+		return data->prev;
+	}
+	return percent > data->prev ? data->prev + step : data->prev - step;
+steady:
+	data->limited_at = now;
+	return percent;
 }
 
 int kraken_x62_update_percent(struct usb_kraken *kraken,
                               struct percent_data *data)
 {
-	u8 curr;
-	int ret = 0;
-
-	mutex_lock(&data->mutex);
+	const ktime_t now = ktime_get();
+	unsigned long flags;
+	bool send, slewing;
+	u8 percent;
 
-	if (!data->update)
-		goto error;
-	curr = percent_msg_get(&data->msg);
-	if (curr == data->prev)
-		goto error;
-	ret = percent_msg_update(&data->msg, kraken);
-	if (ret)
-		goto error;
-	data->prev = curr;
-	data->update = false;
+	spin_lock_irqsave(&data->lock, flags);
+	percent = percent_data_limit(data, now);
+	slewing = data->slewing;
+	// if same percent as previously, no frame necessary
+	send = percent != data->prev;
+	// the completion handler does the bookkeeping once the message is sent
+	if (send) {
+		memcpy(data->urb->transfer_buffer, data->msg.msg,
+		       sizeof(data->msg.msg));
+		percent_msg_set(data->urb->transfer_buffer, percent);
+		data->sent = now;
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
 
-error:
-	mutex_unlock(&data->mutex);
-	return ret;
+	if (slewing)
+		kraken_commands_resend(kraken, BIT(data->command));
+	if (!send)
+		return 0;
+	kraken_command_frames_sent(kraken, 1);
+	return kraken_urb_submit(kraken, data->urb, GFP_KERNEL);
 }
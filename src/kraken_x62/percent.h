@@ -3,7 +3,9 @@
 
 #include "../common.h"
 
-#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
 
 #define PERCENT_MSG_SIZE ((size_t) 5)
 
@@ -22,15 +24,93 @@ struct percent_data {
 
 	struct percent_msg msg;
 	u8 prev;
-	bool update;
+	// when the last frame was sent
+	ktime_t sent;
 
-	struct mutex mutex;
+	// changes of at most the deadband aren't sent, and the percent sent
+	// moves by at most the slew rate per s, 0 if unlimited; slewing is set
+	// while short of the percent written, and limited_at is what the
+	// next slew step is measured from: the time used up by the steps so
+	// far, or the last update if not slewing
+	u8 deadband;
+	u8 slew_rate;
+	bool slewing;
+	ktime_t limited_at;
+	// the nr of frames not sent because of the deadband or slew rate
+	unsigned long suppressed;
+	// the command bit marked when the percent is written
+	unsigned int command;
+
+	// pre-allocated URB sending the message, with a DMA-coherent transfer
+	// buffer
+	struct urb *urb;
+	struct usb_kraken *kraken;
+
+	spinlock_t lock;
 };
 
-void percent_data_init(struct percent_data *data, enum percent_msg_which which);
+int percent_data_init(struct percent_data *data, struct usb_kraken *kraken,
+                      const struct usb_endpoint_descriptor *endpoint,
+                      enum percent_msg_which which, unsigned int command);
+void percent_data_free(struct percent_data *data);
+/**
+ * Store the percent, clamped to the allowed range, without marking it to be
+ * sent.
+ */
+void percent_data_store(struct percent_data *data, unsigned int percent_ui);
+/**
+ * Write the percent, clamped to the allowed range, to be sent by the next
+ * update.
+ */
+void percent_data_write(struct percent_data *data, unsigned int percent_ui);
+/**
+ * Set the percent from the in-kernel control, clamped like writes, to be sent
+ * by the current update, without counting it as a write.
+ */
+void percent_data_control(struct percent_data *data, unsigned int percent_ui);
+/**
+ * Parse a percent as written to attribute attr, warning about it if invalid.
+ */
+int percent_parse(struct device *dev, const char *attr, const char *buf,
+                  unsigned int *percent_ui);
 int percent_data_parse(struct percent_data *data, struct device *dev,
                        const char *attr, const char *buf);
 
+/**
+ * The percent last written, or 0 if none.
+ */
+u8 percent_data_written(struct percent_data *data);
+
+/**
+ * Set the deadband and slew rate, from `DEADBAND SLEW_RATE` in percents and
+ * percents per s.
+ */
+int percent_data_parse_limits(struct percent_data *data, struct device *dev,
+                              const char *attr, const char *buf);
+ssize_t percent_data_show_limits(struct percent_data *data, char *buf);
+
+/**
+ * The nr of frames not sent because of the deadband or slew rate.
+ */
+unsigned long percent_data_suppressed(struct percent_data *data);
+
+/**
+ * The percent last applied to the device, or 0 if none.
+ */
+u8 percent_data_applied(struct percent_data *data);
+
+/**
+ * Forget the percent last sent, as the device has lost it, and mark it to be
+ * sent again if it had been sent at all.
+ */
+void percent_data_reset(struct percent_data *data);
+
+/**
+ * Send the percent if it has changed since last sent, by more than the
+ * deadband, moving towards it by at most the slew rate; if short of it, the
+ * command is marked for the next update to carry on.  Called when the
+ * percent's command has been taken by an update.
+ */
 int kraken_x62_update_percent(struct usb_kraken *kraken,
                               struct percent_data *data);
 
@@ -3,10 +3,20 @@
 
 #include "status.h"
 #include "../common.h"
+#include "../stats.h"
 
+#include <asm/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/printk.h>
+#include <linux/seqlock.h>
 #include <linux/string.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
+
+// backoff between retries after errors, doubling while they persist
+#define RECOVER_DELAY_MIN_MS 13
+#define RECOVER_DELAY_MAX_MS 1000
 
 static const u8 MSG_HEADER_1[] = {
 	0x04,
@@ -15,100 +25,213 @@ static const u8 MSG_FOOTER_1[] = {
 	0x02, 0x00, 0x01, 0x08,
 };
 
-void status_data_init(struct status_data *data)
+static int status_data_submit(struct status_data *data, gfp_t mem_flags)
+{
+	data->submitted = ktime_get();
+	kraken_urb_trace_submit(data->kraken, data->urb, data->submitted);
+	return usb_submit_urb(data->urb, mem_flags);
+}
+
+/* Retry after an error, later, from process context, like usbhid does.
+ */
+static void status_data_recover(struct status_data *data, int error)
 {
-	mutex_init(&data->mutex);
+	data->recover_delay_ms = data->recover_delay_ms == 0
+		? RECOVER_DELAY_MIN_MS
+		: min_t(unsigned int, data->recover_delay_ms * 2,
+		        RECOVER_DELAY_MAX_MS);
+	data->recover_error = error;
+	dev_err_ratelimited(&data->urb->dev->dev,
+	                    "failed status update: %d, retrying in %u ms\n",
+	                    error, data->recover_delay_ms);
+	schedule_delayed_work(&data->recover_work,
+	                      msecs_to_jiffies(data->recover_delay_ms));
 }
 
-u8 status_data_temp_liquid(struct status_data *data)
+static void status_data_recover_work(struct work_struct *work)
 {
-	u8 temp;
-	mutex_lock(&data->mutex);
-	temp = data->msg[1];
-	mutex_unlock(&data->mutex);
+	struct status_data *data
+		= container_of(to_delayed_work(work), struct status_data,
+		               recover_work);
+	struct urb *urb = data->urb;
+	int ret;
 
-	return temp;
+	// a stalled endpoint stays halted until cleared
+	if (data->recover_error == -EPIPE) {
+		ret = usb_clear_halt(urb->dev, urb->pipe);
+		if (ret == -ENODEV)
+			return;
+		if (ret) {
+			status_data_recover(data, -EPIPE);
+			return;
+		}
+	}
+	ret = status_data_submit(data, GFP_KERNEL);
+	// stopped, or disconnected
+	if (ret == -EPERM || ret == -ENODEV)
+		return;
+	if (ret)
+		status_data_recover(data, ret);
 }
 
-u16 status_data_fan_rpm(struct status_data *data)
+static void status_data_urb_complete(struct urb *urb)
 {
-	u16 rpm_be;
-	mutex_lock(&data->mutex);
-	rpm_be = *((u16 *) (data->msg + 3));
-	mutex_unlock(&data->mutex);
+	struct status_data *data = urb->context;
+	const u8 *msg = urb->transfer_buffer;
+	unsigned long flags;
+	int ret = urb->status;
+
+	kraken_urb_complete(data->kraken, urb, KRAKEN_MSG_STATUS,
+	                    data->submitted);
+	switch (ret) {
+	case 0:
+		break;
+	// unlinked or disconnected: stop resubmitting
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return;
+	// protocol errors or a stalled endpoint: resubmitting at once would
+	// likely fail again at once, so retry later, clearing any halt
+	case -EPROTO:
+	case -EILSEQ:
+	case -EPIPE:
+		status_data_recover(data, ret);
+		return;
+	default:
+		dev_err_ratelimited(&urb->dev->dev,
+		                    "failed status update: %d\n", ret);
+		goto resubmit;
+	}
+	if (urb->actual_length != sizeof(data->msg.msg)) {
+		dev_err_ratelimited(&urb->dev->dev,
+		                    "failed status update: received %u bytes\n",
+		                    urb->actual_length);
+		goto resubmit;
+	}
+	// check header #1 & footer #1
+	if (memcmp(msg + 0, MSG_HEADER_1, sizeof(MSG_HEADER_1)) != 0 ||
+	    memcmp(msg + 11, MSG_FOOTER_1, sizeof(MSG_FOOTER_1)) != 0) {
+		char status_hex[sizeof(data->msg.msg) * 3 + 1];
+		hex_dump_to_buffer(msg, sizeof(data->msg.msg), 32, 1,
+		                   status_hex, sizeof(status_hex), false);
+		dev_err_ratelimited(&urb->dev->dev,
+		                    "received invalid status message: %s\n",
+		                    status_hex);
+		kraken_stats_count(data->kraken, KRAKEN_STAT_STATUS_INVALID);
+		goto resubmit;
+	}
 
-	return be16_to_cpu(rpm_be);
+	data->recover_delay_ms = 0;
+	write_seqlock_irqsave(&data->lock, flags);
+	memcpy(data->msg.msg, msg, sizeof(data->msg.msg));
+	data->msg.sequence++;
+	data->msg.received = ktime_get();
+	write_sequnlock_irqrestore(&data->lock, flags);
+	kraken_telemetry_push(data->kraken);
+
+resubmit:
+	// the host controller polls the endpoint at its bInterval
+	ret = status_data_submit(data, GFP_ATOMIC);
+	if (ret && ret != -EPERM && ret != -ENODEV)
+		status_data_recover(data, ret);
 }
 
-u16 status_data_pump_rpm(struct status_data *data)
+int status_data_init(struct status_data *data, struct usb_kraken *kraken,
+                     const struct usb_endpoint_descriptor *endpoint)
 {
-	u16 rpm_be;
-	mutex_lock(&data->mutex);
-	rpm_be = *((u16 *) (data->msg + 5));
-	mutex_unlock(&data->mutex);
+	struct usb_device *udev = kraken->udev;
+	int ret;
 
-	return be16_to_cpu(rpm_be);
+	data->kraken = kraken;
+	seqlock_init(&data->lock);
+	INIT_DELAYED_WORK(&data->recover_work, status_data_recover_work);
+	data->recover_delay_ms = 0;
+	data->started = false;
+
+	data->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (data->urb == NULL)
+		return -ENOMEM;
+	usb_fill_int_urb(data->urb, udev,
+	                 usb_rcvintpipe(udev, endpoint->bEndpointAddress),
+	                 NULL, 0, status_data_urb_complete, data,
+	                 endpoint->bInterval);
+	ret = kraken_urb_buffer(kraken, data->urb, sizeof(data->msg.msg));
+	if (ret)
+		usb_free_urb(data->urb);
+	return ret;
 }
 
-// TODO: [undocumented] figure out what this is
-u8 status_data_unknown_1(struct status_data *data)
+void status_data_free(struct status_data *data)
 {
-	u8 unknown_1;
-	mutex_lock(&data->mutex);
-	unknown_1 = data->msg[2];
-	mutex_unlock(&data->mutex);
+	usb_free_urb(data->urb);
+}
 
-	return unknown_1;
+void status_data_snapshot(struct status_data *data, struct status_msg *msg)
+{
+	unsigned int seq;
+	do {
+		seq = read_seqbegin(&data->lock);
+		memcpy(msg, &data->msg, sizeof(*msg));
+	} while (read_seqretry(&data->lock, seq));
 }
 
-// TODO: [undocumented] figure out what this is
-u32 status_data_unknown_2(struct status_data *data)
+u8 status_msg_temp_liquid(const struct status_msg *msg)
 {
-	u32 unknown_2_be;
-	mutex_lock(&data->mutex);
-	unknown_2_be = *((u32 *) (data->msg + 7));
-	mutex_unlock(&data->mutex);
+	return msg->msg[1];
+}
 
-	return be32_to_cpu(unknown_2_be);
+u16 status_msg_fan_rpm(const struct status_msg *msg)
+{
+	return be16_to_cpup((const __be16 *) (msg->msg + 3));
+}
+
+u16 status_msg_pump_rpm(const struct status_msg *msg)
+{
+	return be16_to_cpup((const __be16 *) (msg->msg + 5));
 }
 
 // TODO: [undocumented] figure out what this is
-u16 status_data_unknown_3(struct status_data *data)
+u8 status_msg_unknown_1(const struct status_msg *msg)
 {
-	u16 unknown_3_be;
-	mutex_lock(&data->mutex);
-	unknown_3_be = *((u16 *) (data->msg + 15));
-	mutex_unlock(&data->mutex);
+	return msg->msg[2];
+}
 
-	return be16_to_cpu(unknown_3_be);
+// TODO: [undocumented] figure out what this is
+u32 status_msg_unknown_2(const struct status_msg *msg)
+{
+	return be32_to_cpup((const __be32 *) (msg->msg + 7));
+}
+
+// TODO: [undocumented] figure out what this is
+u16 status_msg_unknown_3(const struct status_msg *msg)
+{
+	return be16_to_cpup((const __be16 *) (msg->msg + 15));
 }
 
-int kraken_x62_update_status(struct usb_kraken *kraken,
-                             struct status_data *data)
+int status_data_start(struct status_data *data, gfp_t mem_flags)
 {
-	bool invalid;
-	int received;
 	int ret;
-	mutex_lock(&data->mutex);
-	ret = usb_interrupt_msg(kraken->udev, usb_rcvctrlpipe(kraken->udev, 1),
-	                        data->msg, sizeof(data->msg), &received, 1000);
-	mutex_unlock(&data->mutex);
-
-	if (ret || received != sizeof(data->msg)) {
-		dev_err(&kraken->udev->dev,
-		        "failed status update: I/O error\n");
-		return ret ? ret : 1;
-	}
-	// check header #1 & footer #1
-	invalid = false;
-	if (memcmp(data->msg + 0, MSG_HEADER_1, sizeof(MSG_HEADER_1)) != 0 ||
-	    memcmp(data->msg + 11, MSG_FOOTER_1, sizeof(MSG_FOOTER_1)) != 0) {
-		char status_hex[sizeof(data->msg) * 3 + 1];
-		hex_dump_to_buffer(data->msg, sizeof(data->msg), 32, 1,
-		                   status_hex, sizeof(status_hex), false);
-		dev_err(&kraken->udev->dev,
-		        "received invalid status message: %s\n", status_hex);
-		return 1;
-	}
+	usb_unpoison_urb(data->urb);
+	data->recover_delay_ms = 0;
+	ret = status_data_submit(data, mem_flags);
+	if (ret)
+		return ret;
+	// the device is awake here, at probe or resume
+	usb_autopm_get_interface_no_resume(data->kraken->interface);
+	data->started = true;
 	return 0;
 }
+
+void status_data_stop(struct status_data *data)
+{
+	// poisoned, the URB can't be resubmitted by a retry still pending
+	usb_poison_urb(data->urb);
+	cancel_delayed_work_sync(&data->recover_work);
+	// may be called while suspending, so mustn't suspend itself
+	if (data->started) {
+		usb_autopm_put_interface_no_suspend(data->kraken->interface);
+		data->started = false;
+	}
+}
@@ -3,25 +3,71 @@
 
 #include "../common.h"
 
-#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/usb.h>
+#include <linux/workqueue.h>
 
 #define STATUS_DATA_MSG_SIZE ((size_t) 17)
 
-struct status_data {
+/**
+ * A status message as received, from which all fields of a single sample are
+ * read.
+ */
+struct status_msg {
 	u8 msg[STATUS_DATA_MSG_SIZE];
-	struct mutex mutex;
+	// the nr of messages received so far, this one included, and when this
+	// one was received
+	u64 sequence;
+	ktime_t received;
+};
+
+struct status_data {
+	struct status_msg msg;
+
+	// persistent URB receiving the message, with a DMA-coherent transfer
+	// buffer; resubmits itself on completion, and when it was last submitted
+	struct urb *urb;
+	ktime_t submitted;
+	struct usb_kraken *kraken;
+
+	// resubmits the URB after an error, backing off while errors persist:
+	// the error, and the delay before the next retry, 0 after a success
+	struct delayed_work recover_work;
+	int recover_error;
+	unsigned int recover_delay_ms;
+	// whether started, keeping the interface from being autosuspended
+	bool started;
+
+	// readers retry instead of blocking the completion handler
+	seqlock_t lock;
 };
 
-void status_data_init(struct status_data *data);
+int status_data_init(struct status_data *data, struct usb_kraken *kraken,
+                     const struct usb_endpoint_descriptor *endpoint);
+void status_data_free(struct status_data *data);
+
+/**
+ * Copy the latest status message.  Never blocks, and the copy is always a
+ * single whole message.
+ */
+void status_data_snapshot(struct status_data *data, struct status_msg *msg);
 
-u8 status_data_temp_liquid(struct status_data *data);
-u16 status_data_fan_rpm(struct status_data *data);
-u16 status_data_pump_rpm(struct status_data *data);
-u8 status_data_unknown_1(struct status_data *data);
-u32 status_data_unknown_2(struct status_data *data);
-u16 status_data_unknown_3(struct status_data *data);
+u8 status_msg_temp_liquid(const struct status_msg *msg);
+u16 status_msg_fan_rpm(const struct status_msg *msg);
+u16 status_msg_pump_rpm(const struct status_msg *msg);
+u8 status_msg_unknown_1(const struct status_msg *msg);
+u32 status_msg_unknown_2(const struct status_msg *msg);
+u16 status_msg_unknown_3(const struct status_msg *msg);
 
-int kraken_x62_update_status(struct usb_kraken *kraken,
-                             struct status_data *data);
+/**
+ * Start receiving status messages continuously, at the endpoint's polling
+ * interval.  Each valid message received replaces the previous one.  Errors,
+ * such as a stalled endpoint, are recovered from by resubmitting with backoff,
+ * until stopped.  The interface isn't autosuspended while started, as the
+ * status would stop coming.
+ */
+int status_data_start(struct status_data *data, gfp_t mem_flags);
+void status_data_stop(struct status_data *data);
 
 #endif  /* LEVIATHAN_X62_STATUS_H_INCLUDED */
@@ -0,0 +1,269 @@
+/* Implementation of the generic netlink family.
+ */
+
+#include "netlink.h"
+#include "common.h"
+
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <net/genetlink.h>
+#include <net/netlink.h>
+
+// the devices reachable by commands, and by kraken_netlink_call()
+static DEFINE_MUTEX(kraken_netlink_lock);
+static LIST_HEAD(kraken_netlink_devices);
+
+enum kraken_genl_mcgrp {
+	KRAKEN_GENL_MCGRP_TELEMETRY,
+};
+
+static const struct genl_multicast_group kraken_genl_mcgrps[] = {
+	[KRAKEN_GENL_MCGRP_TELEMETRY] = {
+		.name = LEVIATHAN_GENL_MCGRP_TELEMETRY,
+	},
+};
+
+static const struct nla_policy
+kraken_genl_policy[LEVIATHAN_GENL_ATTR_MAX + 1] = {
+	[LEVIATHAN_GENL_ATTR_DEVICE]       = { .type = NLA_U32 },
+	[LEVIATHAN_GENL_ATTR_SERIAL]       = { .type = NLA_NUL_STRING },
+	[LEVIATHAN_GENL_ATTR_TELEMETRY]    = {
+		.type = NLA_BINARY,
+		.len = sizeof(struct leviathan_telemetry),
+	},
+	[LEVIATHAN_GENL_ATTR_FAN_PERCENT]  = { .type = NLA_U8 },
+	[LEVIATHAN_GENL_ATTR_PUMP_PERCENT] = { .type = NLA_U8 },
+};
+
+static struct genl_family kraken_genl_family;
+
+static int kraken_genl_fill_sample(struct sk_buff *skb,
+                                   struct usb_kraken *kraken, u32 portid,
+                                   u32 seq, int flags)
+{
+	struct leviathan_telemetry telemetry;
+	void *hdr = genlmsg_put(skb, portid, seq, &kraken_genl_family, flags,
+	                        LEVIATHAN_GENL_CMD_SAMPLE);
+	if (hdr == NULL)
+		return -EMSGSIZE;
+
+	kraken_telemetry(kraken, &telemetry);
+	if (nla_put_u32(skb, LEVIATHAN_GENL_ATTR_DEVICE,
+	                kraken->interface->minor) ||
+	    nla_put_string(skb, LEVIATHAN_GENL_ATTR_SERIAL,
+	                   kraken_driver_serial(kraken)) ||
+	    nla_put(skb, LEVIATHAN_GENL_ATTR_TELEMETRY, sizeof(telemetry),
+	            &telemetry)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(skb, hdr);
+	return 0;
+}
+
+/* Find the device with the given minor.  Must be called with
+ * kraken_netlink_lock held.
+ */
+static struct usb_kraken *kraken_netlink_find(u32 minor)
+{
+	struct usb_kraken *kraken;
+	list_for_each_entry(kraken, &kraken_netlink_devices, netlink_node) {
+		if (kraken->interface->minor == minor)
+			return kraken;
+	}
+	return NULL;
+}
+
+static int kraken_genl_get_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct usb_kraken *kraken;
+	struct sk_buff *msg;
+	int ret;
+
+	if (info->attrs[LEVIATHAN_GENL_ATTR_DEVICE] == NULL)
+		return -EINVAL;
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (msg == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&kraken_netlink_lock);
+	kraken = kraken_netlink_find(
+		nla_get_u32(info->attrs[LEVIATHAN_GENL_ATTR_DEVICE]));
+	if (kraken == NULL)
+		ret = -ENODEV;
+	else
+		ret = kraken_genl_fill_sample(msg, kraken, info->snd_portid,
+		                              info->snd_seq, 0);
+	mutex_unlock(&kraken_netlink_lock);
+
+	if (ret) {
+		nlmsg_free(msg);
+		return ret;
+	}
+	return genlmsg_reply(msg, info);
+}
+
+static int kraken_genl_get_dumpit(struct sk_buff *skb,
+                                  struct netlink_callback *cb)
+{
+	struct usb_kraken *kraken;
+	// the nr of devices dumped by previous calls
+	const long skip = cb->args[0];
+	long i = 0;
+
+	mutex_lock(&kraken_netlink_lock);
+	list_for_each_entry(kraken, &kraken_netlink_devices, netlink_node) {
+		if (i < skip) {
+			i++;
+			continue;
+		}
+		// out of room: continue from here in the next call
+		if (kraken_genl_fill_sample(skb, kraken,
+		                            NETLINK_CB(cb->skb).portid,
+		                            cb->nlh->nlmsg_seq, NLM_F_MULTI))
+			break;
+		i++;
+	}
+	mutex_unlock(&kraken_netlink_lock);
+
+	cb->args[0] = i;
+	return skb->len;
+}
+
+static bool kraken_netlink_percent_valid(struct usb_kraken *kraken,
+                                         enum kraken_percent which,
+                                         const struct nlattr *attr)
+{
+	const u8 percent = nla_get_u8(attr);
+	u8 min, max;
+	kraken_driver_percent_bounds(kraken, which, &min, &max);
+	return percent >= min && percent <= max;
+}
+
+static int kraken_genl_set_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct usb_kraken *kraken;
+	struct nlattr *fan = info->attrs[LEVIATHAN_GENL_ATTR_FAN_PERCENT];
+	struct nlattr *pump = info->attrs[LEVIATHAN_GENL_ATTR_PUMP_PERCENT];
+	int ret = 0;
+
+	if (info->attrs[LEVIATHAN_GENL_ATTR_DEVICE] == NULL)
+		return -EINVAL;
+
+	mutex_lock(&kraken_netlink_lock);
+	kraken = kraken_netlink_find(
+		nla_get_u32(info->attrs[LEVIATHAN_GENL_ATTR_DEVICE]));
+	if (kraken == NULL) {
+		ret = -ENODEV;
+		goto out;
+	}
+	// either both percents are set, or neither is
+	if ((fan != NULL && !kraken_netlink_percent_valid(
+		kraken, KRAKEN_PERCENT_FAN, fan)) ||
+	    (pump != NULL && !kraken_netlink_percent_valid(
+		kraken, KRAKEN_PERCENT_PUMP, pump))) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (fan != NULL)
+		ret = kraken_driver_percent_write(kraken, KRAKEN_PERCENT_FAN,
+		                                  nla_get_u8(fan));
+	if (ret == 0 && pump != NULL)
+		ret = kraken_driver_percent_write(kraken, KRAKEN_PERCENT_PUMP,
+		                                  nla_get_u8(pump));
+out:
+	mutex_unlock(&kraken_netlink_lock);
+	return ret;
+}
+
+static const struct genl_ops kraken_genl_ops[] = {
+	{
+		.cmd    = LEVIATHAN_GENL_CMD_GET,
+		.doit   = kraken_genl_get_doit,
+		.dumpit = kraken_genl_get_dumpit,
+	},
+	{
+		.cmd    = LEVIATHAN_GENL_CMD_SET,
+		.doit   = kraken_genl_set_doit,
+		.flags  = GENL_ADMIN_PERM,
+	},
+};
+
+// named after the driver at init
+static struct genl_family kraken_genl_family = {
+	.version       = LEVIATHAN_GENL_VERSION,
+	.maxattr       = LEVIATHAN_GENL_ATTR_MAX,
+	.policy        = kraken_genl_policy,
+	.module        = THIS_MODULE,
+	.ops           = kraken_genl_ops,
+	.n_ops         = ARRAY_SIZE(kraken_genl_ops),
+	.resv_start_op = LEVIATHAN_GENL_CMD_MAX + 1,
+	.mcgrps        = kraken_genl_mcgrps,
+	.n_mcgrps      = ARRAY_SIZE(kraken_genl_mcgrps),
+};
+
+int kraken_netlink_init(void)
+{
+	strscpy(kraken_genl_family.name, kraken_driver_name,
+	        sizeof(kraken_genl_family.name));
+	return genl_register_family(&kraken_genl_family);
+}
+
+void kraken_netlink_exit(void)
+{
+	genl_unregister_family(&kraken_genl_family);
+}
+
+void kraken_netlink_add(struct usb_kraken *kraken)
+{
+	mutex_lock(&kraken_netlink_lock);
+	list_add_tail(&kraken->netlink_node, &kraken_netlink_devices);
+	mutex_unlock(&kraken_netlink_lock);
+}
+
+void kraken_netlink_remove(struct usb_kraken *kraken)
+{
+	mutex_lock(&kraken_netlink_lock);
+	list_del(&kraken->netlink_node);
+	mutex_unlock(&kraken_netlink_lock);
+}
+
+int kraken_netlink_call(const struct kraken_ring *ring,
+                        int (*call)(struct usb_kraken *kraken, void *arg),
+                        void *arg)
+{
+	struct usb_kraken *kraken;
+	int ret = -ENODEV;
+
+	// matched by the ring rather than the minor, which another device may
+	// have taken since the file was opened
+	mutex_lock(&kraken_netlink_lock);
+	list_for_each_entry(kraken, &kraken_netlink_devices, netlink_node) {
+		if (kraken->ring == ring) {
+			ret = call(kraken, arg);
+			break;
+		}
+	}
+	mutex_unlock(&kraken_netlink_lock);
+	return ret;
+}
+
+void kraken_netlink_sample(struct usb_kraken *kraken)
+{
+	struct sk_buff *msg;
+
+	if (!genl_has_listeners(&kraken_genl_family, &init_net,
+	                        KRAKEN_GENL_MCGRP_TELEMETRY))
+		return;
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (msg == NULL)
+		return;
+	if (kraken_genl_fill_sample(msg, kraken, 0, 0, 0)) {
+		nlmsg_free(msg);
+		return;
+	}
+	genlmsg_multicast(&kraken_genl_family, msg, 0,
+	                  KRAKEN_GENL_MCGRP_TELEMETRY, GFP_KERNEL);
+}
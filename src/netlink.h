@@ -0,0 +1,38 @@
+/* Generic netlink family of the driver, multicasting telemetry samples and
+ * accepting get/set commands.
+ */
+
+#ifndef LEVIATHAN_NETLINK_H_INCLUDED
+#define LEVIATHAN_NETLINK_H_INCLUDED
+
+#include "common.h"
+
+/**
+ * Register and unregister the family.  Called at module init and exit.
+ */
+int kraken_netlink_init(void);
+void kraken_netlink_exit(void);
+
+/**
+ * Make the device reachable by commands, or no longer.  Called from
+ * kraken_probe() and kraken_disconnect().
+ */
+void kraken_netlink_add(struct usb_kraken *kraken);
+void kraken_netlink_remove(struct usb_kraken *kraken);
+
+/**
+ * Call a function on the device owning the given ring, as held open by a file
+ * of its character device, serialized with its disconnect, as commands are.
+ * Returns what the function returns, or -ENODEV if the device is gone.
+ */
+int kraken_netlink_call(const struct kraken_ring *ring,
+                        int (*call)(struct usb_kraken *kraken, void *arg),
+                        void *arg);
+
+/**
+ * Multicast the device's latest sample, if anyone is listening.  Called from
+ * the update work.
+ */
+void kraken_netlink_sample(struct usb_kraken *kraken);
+
+#endif  /* LEVIATHAN_NETLINK_H_INCLUDED */
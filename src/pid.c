@@ -0,0 +1,178 @@
+/* Implementation of the PID controllers.
+ */
+
+#include "pid.h"
+#include "util.h"
+
+#include <linux/ctype.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+// in m°C
+#define PID_SETPOINT_MAX 1000000
+// the gains, in thousandths, are bounded so that no term can overflow
+#define PID_GAIN_MAX 1000000
+// the time between two runs taken into account, in ms
+#define PID_DT_MAX_MS 10000
+
+/* Parse a decimal with up to 3 decimal places into thousandths, bounded to
+ * [-max, max].
+ */
+static int kraken_pid_parse_milli(const char *word, s64 max, s64 *milli)
+{
+	const bool negative = word[0] == '-';
+	const char *dot;
+	char whole[WORD_LEN_MAX];
+	unsigned int i, places = 0;
+	u32 value;
+	s64 frac = 0;
+
+	if (negative)
+		word++;
+	dot = strchr(word, '.');
+	if (dot == NULL)
+		dot = word + strlen(word);
+	if (dot == word)
+		return -EINVAL;
+	memcpy(whole, word, dot - word);
+	whole[dot - word] = '\0';
+	if (whole[0] == '+' || kstrtou32(whole, 10, &value))
+		return -EINVAL;
+	if (*dot == '.') {
+		for (i = 1; dot[i] != '\0'; i++) {
+			if (!isdigit(dot[i]) || ++places > 3)
+				return -EINVAL;
+			frac = frac * 10 + (dot[i] - '0');
+		}
+		if (places == 0)
+			return -EINVAL;
+		for (; places < 3; places++)
+			frac *= 10;
+	}
+	*milli = (s64) value * 1000 + frac;
+	if (*milli > max)
+		return -EINVAL;
+	if (negative)
+		*milli = -*milli;
+	return 0;
+}
+
+int kraken_pid_parse(struct kraken_pid_config *config, const char *buf)
+{
+	char word[WORD_LEN_MAX];
+	s64 *const values[] = {
+		&config->setpoint, &config->kp, &config->ki, &config->kd,
+	};
+	unsigned int i;
+
+	memset(config, 0, sizeof(*config));
+	if (str_scan_word(&buf, word))
+		return -EINVAL;
+	if (strcmp(word, "none") == 0)
+		return buf[0] == '\0' ? 0 : -EINVAL;
+
+	// SETPOINT KP KI KD, the setpoint in °C and the gains in percents per
+	// °C, °C·s and °C/s
+	for (i = 0; i < ARRAY_SIZE(values); i++) {
+		const s64 max = i == 0 ? PID_SETPOINT_MAX : PID_GAIN_MAX;
+		if ((i > 0 && str_scan_word(&buf, word)) ||
+		    kraken_pid_parse_milli(word, max, values[i]))
+			return -EINVAL;
+	}
+	if (buf[0] != '\0' || config->setpoint < -273000)
+		return -EINVAL;
+	config->on = true;
+	return 0;
+}
+
+/* Print a value in thousandths as a decimal, preceded by a space unless first.
+ */
+static int kraken_pid_show_milli(char *buf, size_t size, s64 milli,
+                                 bool first)
+{
+	u32 rem;
+	const u64 whole = div_u64_rem(abs(milli), 1000, &rem);
+	return scnprintf(buf, size, "%s%s%llu.%03u", first ? "" : " ",
+	                 milli < 0 ? "-" : "", whole, rem);
+}
+
+ssize_t kraken_pid_show(const struct kraken_pid *pid, char *buf)
+{
+	const struct kraken_pid_config *config = &pid->config;
+	ssize_t len;
+	if (!config->on)
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	len = kraken_pid_show_milli(buf, PAGE_SIZE, config->setpoint, true);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, config->kp,
+	                             false);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, config->ki,
+	                             false);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, config->kd,
+	                             false);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+ssize_t kraken_pid_show_terms(const struct kraken_pid *pid, char *buf)
+{
+	ssize_t len;
+	if (!pid->config.on || !pid->primed)
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	len = kraken_pid_show_milli(buf, PAGE_SIZE, pid->error, true);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, pid->p, false);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, pid->i, false);
+	len += kraken_pid_show_milli(buf + len, PAGE_SIZE - len, pid->d, false);
+	len += scnprintf(buf + len, PAGE_SIZE - len, " %u\n", pid->output);
+	return len;
+}
+
+void kraken_pid_set(struct kraken_pid *pid,
+                    const struct kraken_pid_config *config)
+{
+	memset(pid, 0, sizeof(*pid));
+	pid->config = *config;
+}
+
+unsigned int kraken_pid_run(struct kraken_pid *pid, int temp, ktime_t now,
+                            u8 min, u8 max)
+{
+	const struct kraken_pid_config *config = &pid->config;
+	const s64 min_milli = (s64) min * 1000;
+	const s64 max_milli = (s64) max * 1000;
+	s64 output;
+
+	// positive when too hot, calling for more cooling
+	pid->error = temp - config->setpoint;
+	pid->p = div_s64(config->kp * pid->error, 1000);
+	if (!pid->primed) {
+		// nothing to integrate or differentiate over yet: start from
+		// the bottom of the range
+		pid->i = min_milli;
+		pid->d = 0;
+		pid->primed = true;
+	} else {
+		const s64 dt_ms = clamp_t(s64,
+		                          ktime_ms_delta(now, pid->time_prev),
+		                          1, PID_DT_MAX_MS);
+		// on the measurement rather than the error, so that changing
+		// the setpoint doesn't kick the output
+		pid->d = div_s64(config->kd * (temp - pid->temp_prev), dt_ms);
+		// anti-windup: don't integrate any further into saturation
+		output = pid->p + pid->i + pid->d;
+		if (!(output >= max_milli && pid->error > 0) &&
+		    !(output <= min_milli && pid->error < 0))
+			pid->i += div_s64(config->ki * pid->error * dt_ms,
+			                  1000000);
+	}
+	// and the integral alone never beyond the bounds, which it must be
+	// within to hold the setpoint at zero error
+	pid->i = clamp_t(s64, pid->i, min_milli, max_milli);
+	pid->temp_prev = temp;
+	pid->time_prev = now;
+
+	output = clamp_t(s64, pid->p + pid->i + pid->d, min_milli, max_milli);
+	pid->output = div_s64(output + 500, 1000);
+	return pid->output;
+}
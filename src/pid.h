@@ -0,0 +1,70 @@
+/* Fixed-point PID controllers holding the liquid temperature at a setpoint, run
+ * by the updates to control the fan and pump.
+ */
+
+#ifndef LEVIATHAN_PID_H_INCLUDED
+#define LEVIATHAN_PID_H_INCLUDED
+
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+/**
+ * A controller's configuration, in thousandths: the setpoint in m°C, and the
+ * gains in thousandths of a percent per °C (proportional), per °C·s (integral)
+ * and per °C/s (derivative).
+ */
+struct kraken_pid_config {
+	bool on;
+	s64 setpoint;
+	s64 kp;
+	s64 ki;
+	s64 kd;
+};
+
+/**
+ * A controller: its configuration, state and the terms of its last output,
+ * all in thousandths (m°C, or thousandths of a percent).
+ */
+struct kraken_pid {
+	struct kraken_pid_config config;
+
+	// false until the first temperature
+	bool primed;
+	s64 temp_prev;
+	ktime_t time_prev;
+
+	s64 error;
+	s64 p;
+	s64 i;
+	s64 d;
+	unsigned int output;
+};
+
+/**
+ * Parse a configuration as written to attribute `fan_pid` or `pump_pid`.
+ * Returns -EINVAL if invalid.
+ */
+int kraken_pid_parse(struct kraken_pid_config *config, const char *buf);
+
+/**
+ * Print a controller's configuration, as read from attribute `fan_pid` or
+ * `pump_pid`, or its terms, as read from `fan_pid_terms` or `pump_pid_terms`.
+ */
+ssize_t kraken_pid_show(const struct kraken_pid *pid, char *buf);
+ssize_t kraken_pid_show_terms(const struct kraken_pid *pid, char *buf);
+
+/**
+ * Configure a controller, resetting its state.
+ */
+void kraken_pid_set(struct kraken_pid *pid,
+                    const struct kraken_pid_config *config);
+
+/**
+ * Run a controller, which must be on, on a temperature in m°C measured at the
+ * given time, with its output bounded to [min, max] percents.  Returns the
+ * output percent.
+ */
+unsigned int kraken_pid_run(struct kraken_pid *pid, int temp, ktime_t now,
+                            u8 min, u8 max);
+
+#endif  /* LEVIATHAN_PID_H_INCLUDED */
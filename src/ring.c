@@ -0,0 +1,93 @@
+/* Implementation of the telemetry history ring.
+ */
+
+#include "ring.h"
+
+#include <linux/compiler.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+struct kraken_ring *kraken_ring_alloc(u32 records)
+{
+	struct kraken_ring *ring;
+	// the slots stay the same as the 32-bit head and tail wrap around
+	if (records == 0 || records > 1U << 31)
+		return NULL;
+	records = roundup_pow_of_two(records);
+	ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL)
+		return NULL;
+	ring->size = PAGE_ALIGN(PAGE_SIZE +
+	                        (size_t) records * sizeof(*ring->records));
+	ring->header = vmalloc_user(ring->size);
+	if (ring->header == NULL) {
+		kfree(ring);
+		return NULL;
+	}
+	// the records start at the second page
+	ring->records = (void *) ring->header + PAGE_SIZE;
+	kref_init(&ring->kref);
+	spin_lock_init(&ring->lock);
+
+	ring->header->version = LEVIATHAN_RING_VERSION;
+	ring->header->header_size = PAGE_SIZE;
+	ring->header->record_size = sizeof(*ring->records);
+	ring->header->records = records;
+	ring->header->head = 0;
+	ring->header->tail = 0;
+	ring->pushed = 0;
+	return ring;
+}
+
+void kraken_ring_get(struct kraken_ring *ring)
+{
+	kref_get(&ring->kref);
+}
+
+static void kraken_ring_release(struct kref *kref)
+{
+	struct kraken_ring *ring = container_of(kref, struct kraken_ring, kref);
+	vfree(ring->header);
+	kfree(ring);
+}
+
+void kraken_ring_put(struct kraken_ring *ring)
+{
+	kref_put(&ring->kref, kraken_ring_release);
+}
+
+void kraken_ring_push(struct kraken_ring *ring,
+                      const struct leviathan_telemetry *telemetry)
+{
+	struct leviathan_ring *header = ring->header;
+	const u32 records = header->records;
+	unsigned long flags;
+	u64 head;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	head = ring->pushed++;
+	// full: the oldest record is overwritten, so it's given up first
+	if (head >= records) {
+		WRITE_ONCE(header->tail, (u32) (head + 1 - records));
+		smp_wmb();
+	}
+	memcpy(&ring->records[head & (records - 1)], telemetry,
+	       sizeof(*telemetry));
+	// the record is complete before it's published
+	smp_wmb();
+	WRITE_ONCE(header->head, (u32) (head + 1));
+	spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+int kraken_ring_mmap(struct kraken_ring *ring, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, ring->header, 0);
+}
@@ -0,0 +1,48 @@
+/* History ring of telemetry samples, memory-mappable by userspace.
+ */
+
+#ifndef LEVIATHAN_RING_H_INCLUDED
+#define LEVIATHAN_RING_H_INCLUDED
+
+#include "uapi/leviathan.h"
+
+#include <linux/kref.h>
+#include <linux/mm_types.h>
+#include <linux/spinlock.h>
+
+/**
+ * The ring's memory is a header page followed by the records, allocated by
+ * vmalloc_user() so that it can be mapped.  The ring is reference counted, as
+ * open files may outlive the device.
+ */
+struct kraken_ring {
+	struct kref kref;
+	spinlock_t lock;
+	struct leviathan_ring *header;
+	struct leviathan_telemetry *records;
+	size_t size;
+	// the nr of records written so far, which the header's head wraps
+	u64 pushed;
+};
+
+/**
+ * Allocate a ring of at least the given nr of records, rounded up to a power
+ * of two.
+ */
+struct kraken_ring *kraken_ring_alloc(u32 records);
+void kraken_ring_get(struct kraken_ring *ring);
+void kraken_ring_put(struct kraken_ring *ring);
+
+/**
+ * Append a sample, overwriting the oldest one if full.  Safe to call from URB
+ * completion handlers.
+ */
+void kraken_ring_push(struct kraken_ring *ring,
+                      const struct leviathan_telemetry *telemetry);
+
+/**
+ * Map the ring read-only into the given area, which may not extend past it.
+ */
+int kraken_ring_mmap(struct kraken_ring *ring, struct vm_area_struct *vma);
+
+#endif  /* LEVIATHAN_RING_H_INCLUDED */
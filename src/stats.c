@@ -0,0 +1,207 @@
+/* Implementation of the per-device statistics.
+ */
+
+#include "stats.h"
+
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+static const char *const kraken_msg_names[KRAKEN_MSGS] = {
+	[KRAKEN_MSG_STATUS]  = "status",
+	[KRAKEN_MSG_PERCENT] = "percent",
+	[KRAKEN_MSG_LED]     = "led",
+	[KRAKEN_MSG_CONTROL] = "control",
+	[KRAKEN_MSG_BULK]    = "bulk",
+};
+
+static const char *const kraken_stat_names[KRAKEN_STATS] = {
+	[KRAKEN_STAT_TICKS_SKIPPED]  = "ticks_skipped",
+	[KRAKEN_STAT_TIMEOUTS]       = "timeouts",
+	[KRAKEN_STAT_UPDATES_FAILED] = "updates_failed",
+	[KRAKEN_STAT_STATUS_INVALID] = "status_invalid",
+};
+
+static struct dentry *kraken_stats_root;
+
+static unsigned int kraken_stats_bucket(ktime_t latency)
+{
+	const s64 us = ktime_to_us(latency);
+	if (us <= 0)
+		return 0;
+	return min_t(unsigned int, fls64(us), KRAKEN_STATS_BUCKETS - 1);
+}
+
+void kraken_stats_urb(struct usb_kraken *kraken, enum kraken_msg msg,
+                      const struct urb *urb, ktime_t latency)
+{
+	switch (urb->status) {
+	case 0:
+		if (urb->actual_length != urb->transfer_buffer_length)
+			this_cpu_inc(kraken->stats->urbs_short[msg]);
+		break;
+	// unlinked or disconnected: it never got its answer, so it has no
+	// latency
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		this_cpu_inc(kraken->stats->urbs_unlinked[msg]);
+		return;
+	default:
+		this_cpu_inc(kraken->stats->urbs_failed[msg]);
+		break;
+	}
+	this_cpu_inc(kraken->stats->latency[msg][kraken_stats_bucket(latency)]);
+}
+
+void kraken_stats_jitter(struct usb_kraken *kraken, ktime_t jitter)
+{
+	this_cpu_inc(kraken->stats->jitter[kraken_stats_bucket(jitter)]);
+}
+
+void kraken_stats_count(struct usb_kraken *kraken, enum kraken_stat stat)
+{
+	this_cpu_inc(kraken->stats->counts[stat]);
+}
+
+/* Sum up the counters of every CPU.  The sums are not a consistent snapshot,
+ * as the counters go on being incremented meanwhile.
+ */
+static void kraken_stats_sum(struct usb_kraken *kraken,
+                             struct kraken_stats *sum)
+{
+	unsigned int cpu, i, j;
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		const struct kraken_stats *stats
+			= per_cpu_ptr(kraken->stats, cpu);
+		for (i = 0; i < KRAKEN_MSGS; i++) {
+			const u64 *latency = stats->latency[i];
+			for (j = 0; j < KRAKEN_STATS_BUCKETS; j++)
+				sum->latency[i][j] += READ_ONCE(latency[j]);
+			sum->urbs_failed[i] += READ_ONCE(stats->urbs_failed[i]);
+			sum->urbs_short[i] += READ_ONCE(stats->urbs_short[i]);
+			sum->urbs_unlinked[i]
+				+= READ_ONCE(stats->urbs_unlinked[i]);
+		}
+		for (j = 0; j < KRAKEN_STATS_BUCKETS; j++)
+			sum->jitter[j] += READ_ONCE(stats->jitter[j]);
+		for (i = 0; i < KRAKEN_STATS; i++)
+			sum->counts[i] += READ_ONCE(stats->counts[i]);
+	}
+}
+
+/* Print the upper bound of a bucket in us, or "inf" for the last one.
+ */
+static void kraken_stats_show_bucket(struct seq_file *file, unsigned int bucket)
+{
+	if (bucket == KRAKEN_STATS_BUCKETS - 1)
+		seq_printf(file, "%10s", "inf");
+	else
+		seq_printf(file, "%10llu", 1ULL << bucket);
+}
+
+static int latency_show(struct seq_file *file, void *unused)
+{
+	struct usb_kraken *kraken = file->private;
+	struct kraken_stats *sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	unsigned int i, j;
+	if (sum == NULL)
+		return -ENOMEM;
+	kraken_stats_sum(kraken, sum);
+
+	seq_printf(file, "%10s", "below_us");
+	for (i = 0; i < KRAKEN_MSGS; i++)
+		seq_printf(file, " %10s", kraken_msg_names[i]);
+	seq_putc(file, '\n');
+	for (j = 0; j < KRAKEN_STATS_BUCKETS; j++) {
+		kraken_stats_show_bucket(file, j);
+		for (i = 0; i < KRAKEN_MSGS; i++)
+			seq_printf(file, " %10llu", sum->latency[i][j]);
+		seq_putc(file, '\n');
+	}
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int jitter_show(struct seq_file *file, void *unused)
+{
+	struct usb_kraken *kraken = file->private;
+	struct kraken_stats *sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	unsigned int j;
+	if (sum == NULL)
+		return -ENOMEM;
+	kraken_stats_sum(kraken, sum);
+
+	seq_printf(file, "%10s %10s\n", "below_us", "updates");
+	for (j = 0; j < KRAKEN_STATS_BUCKETS; j++) {
+		kraken_stats_show_bucket(file, j);
+		seq_printf(file, " %10llu\n", sum->jitter[j]);
+	}
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(jitter);
+
+static int errors_show(struct seq_file *file, void *unused)
+{
+	struct usb_kraken *kraken = file->private;
+	struct kraken_stats *sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	unsigned int i;
+	if (sum == NULL)
+		return -ENOMEM;
+	kraken_stats_sum(kraken, sum);
+
+	for (i = 0; i < KRAKEN_MSGS; i++)
+		seq_printf(file, "%s failed=%llu short=%llu unlinked=%llu\n",
+		           kraken_msg_names[i], sum->urbs_failed[i],
+		           sum->urbs_short[i], sum->urbs_unlinked[i]);
+	for (i = 0; i < KRAKEN_STATS; i++)
+		seq_printf(file, "%s %llu\n", kraken_stat_names[i],
+		           sum->counts[i]);
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(errors);
+
+void kraken_stats_init(void)
+{
+	kraken_stats_root = debugfs_create_dir(kraken_driver_name, NULL);
+}
+
+void kraken_stats_exit(void)
+{
+	debugfs_remove_recursive(kraken_stats_root);
+}
+
+int kraken_stats_add(struct usb_kraken *kraken)
+{
+	kraken->stats = alloc_percpu(struct kraken_stats);
+	if (kraken->stats == NULL)
+		return -ENOMEM;
+	// named after the interface, like its sysfs directory
+	kraken->debugfs = debugfs_create_dir(dev_name(&kraken->interface->dev),
+	                                     kraken_stats_root);
+	debugfs_create_file("latency", 0444, kraken->debugfs, kraken,
+	                    &latency_fops);
+	debugfs_create_file("jitter", 0444, kraken->debugfs, kraken,
+	                    &jitter_fops);
+	debugfs_create_file("errors", 0444, kraken->debugfs, kraken,
+	                    &errors_fops);
+	return 0;
+}
+
+void kraken_stats_remove(struct usb_kraken *kraken)
+{
+	// waits for any reader of the files to finish
+	debugfs_remove_recursive(kraken->debugfs);
+	free_percpu(kraken->stats);
+}
@@ -0,0 +1,76 @@
+/* Per-device statistics of the USB traffic and of the updates, kept in per-CPU
+ * counters and exposed in debugfs.
+ */
+
+#ifndef LEVIATHAN_STATS_H_INCLUDED
+#define LEVIATHAN_STATS_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/ktime.h>
+#include <linux/usb.h>
+
+// log2 buckets of latencies in us: bucket 0 is below 1 us, bucket b > 0 is
+// [2^(b-1), 2^b) us, and the last bucket takes everything longer
+#define KRAKEN_STATS_BUCKETS 24
+
+/**
+ * The events counted besides those of URBs.
+ */
+enum kraken_stat {
+	// timer ticks which found the update work still queued
+	KRAKEN_STAT_TICKS_SKIPPED,
+	// updates whose URBs didn't all complete in time
+	KRAKEN_STAT_TIMEOUTS,
+	KRAKEN_STAT_UPDATES_FAILED,
+	// status messages rejected by the header/footer check
+	KRAKEN_STAT_STATUS_INVALID,
+	KRAKEN_STATS,
+};
+
+/**
+ * The counters of one CPU; the totals are their sums.
+ */
+struct kraken_stats {
+	u64 latency[KRAKEN_MSGS][KRAKEN_STATS_BUCKETS];
+	// from the timer tick to the start of the update work
+	u64 jitter[KRAKEN_STATS_BUCKETS];
+	u64 urbs_failed[KRAKEN_MSGS];
+	u64 urbs_short[KRAKEN_MSGS];
+	u64 urbs_unlinked[KRAKEN_MSGS];
+	u64 counts[KRAKEN_STATS];
+};
+
+/**
+ * Create and remove the driver's debugfs directory.  Called at module init and
+ * exit.
+ */
+void kraken_stats_init(void);
+void kraken_stats_exit(void);
+
+/**
+ * Allocate the device's counters and create its debugfs directory, or remove
+ * and free them.  Called from kraken_probe() and kraken_disconnect().  Only
+ * failing to allocate is an error; debugfs is optional.
+ */
+int kraken_stats_add(struct usb_kraken *kraken);
+void kraken_stats_remove(struct usb_kraken *kraken);
+
+/**
+ * Count a completed URB of the given message type, with its latency unless
+ * unlinked.  Safe to call from URB completion handlers.
+ */
+void kraken_stats_urb(struct usb_kraken *kraken, enum kraken_msg msg,
+                      const struct urb *urb, ktime_t latency);
+
+/**
+ * Count the delay of an update work from the timer tick which queued it.
+ */
+void kraken_stats_jitter(struct usb_kraken *kraken, ktime_t jitter);
+
+/**
+ * Count an event.  Safe to call from any context.
+ */
+void kraken_stats_count(struct usb_kraken *kraken, enum kraken_stat stat);
+
+#endif  /* LEVIATHAN_STATS_H_INCLUDED */
@@ -0,0 +1,134 @@
+/* Tracepoints around the update cycle.  Each module defines them in its own
+ * trace system, named after the driver, by defining LEVIATHAN_TRACE_SYSTEM and
+ * CREATE_TRACE_POINTS in exactly one of its objects.
+ */
+
+#undef TRACE_SYSTEM
+#ifdef LEVIATHAN_TRACE_SYSTEM
+#define TRACE_SYSTEM LEVIATHAN_TRACE_SYSTEM
+#else
+#define TRACE_SYSTEM leviathan
+#endif
+
+#if !defined(LEVIATHAN_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define LEVIATHAN_TRACE_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+TRACE_EVENT(leviathan_timer,
+	TP_PROTO(struct usb_kraken *kraken, ktime_t now, ktime_t expires),
+	TP_ARGS(kraken, now, expires),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		// negative if woken early, within the slack
+		__field(s64, late_ns)
+	),
+	TP_fast_assign(
+		__entry->busnum = kraken->udev->bus->busnum;
+		__entry->devnum = kraken->udev->devnum;
+		__entry->late_ns = ktime_to_ns(ktime_sub(now, expires));
+	),
+	TP_printk("%03d:%03d late_ns=%lld", __entry->busnum, __entry->devnum,
+	          __entry->late_ns)
+);
+
+TRACE_EVENT(leviathan_update_start,
+	TP_PROTO(struct usb_kraken *kraken),
+	TP_ARGS(kraken),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+	),
+	TP_fast_assign(
+		__entry->busnum = kraken->udev->bus->busnum;
+		__entry->devnum = kraken->udev->devnum;
+	),
+	TP_printk("%03d:%03d", __entry->busnum, __entry->devnum)
+);
+
+TRACE_EVENT(leviathan_update_end,
+	TP_PROTO(struct usb_kraken *kraken, int ret),
+	TP_ARGS(kraken, ret),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(int, ret)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__entry->busnum = kraken->udev->bus->busnum;
+		__entry->devnum = kraken->udev->devnum;
+		__entry->ret = ret;
+		__entry->duration_ns = ktime_to_ns(
+			ktime_sub(ktime_get(), kraken->update_start));
+	),
+	TP_printk("%03d:%03d ret=%d duration_ns=%lld", __entry->busnum,
+	          __entry->devnum, __entry->ret, __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(leviathan_urb,
+	TP_PROTO(struct usb_kraken *kraken, struct urb *urb, ktime_t since),
+	TP_ARGS(kraken, urb, since),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(const void *, urb)
+		__field(unsigned int, type)
+		__field(unsigned int, endpoint)
+		__field(bool, in)
+		__field(u32, length)
+		__field(u32, actual_length)
+		__field(int, status)
+		// on submission, since the start of the update (0 for URBs
+		// not part of one); on completion, since the submission
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->busnum = kraken->udev->bus->busnum;
+		__entry->devnum = kraken->udev->devnum;
+		__entry->urb = urb;
+		__entry->type = usb_pipetype(urb->pipe);
+		__entry->endpoint = usb_pipeendpoint(urb->pipe);
+		__entry->in = usb_pipein(urb->pipe);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual_length = urb->actual_length;
+		__entry->status = urb->status;
+		__entry->latency_ns = ktime_to_ns(
+			ktime_sub(ktime_get(), since));
+	),
+	TP_printk("%03d:%03d urb=%p type=%s ep=%u%s length=%u actual=%u "
+	          "status=%d latency_ns=%lld",
+	          __entry->busnum, __entry->devnum, __entry->urb,
+	          __print_symbolic(__entry->type,
+	                           { PIPE_ISOCHRONOUS, "iso" },
+	                           { PIPE_INTERRUPT,   "int" },
+	                           { PIPE_CONTROL,     "ctrl" },
+	                           { PIPE_BULK,        "bulk" }),
+	          __entry->endpoint, __entry->in ? "in" : "out",
+	          __entry->length, __entry->actual_length, __entry->status,
+	          __entry->latency_ns)
+);
+
+DEFINE_EVENT(leviathan_urb, leviathan_urb_submit,
+	TP_PROTO(struct usb_kraken *kraken, struct urb *urb, ktime_t since),
+	TP_ARGS(kraken, urb, since)
+);
+
+DEFINE_EVENT(leviathan_urb, leviathan_urb_complete,
+	TP_PROTO(struct usb_kraken *kraken, struct urb *urb, ktime_t since),
+	TP_ARGS(kraken, urb, since)
+);
+
+#endif  /* LEVIATHAN_TRACE_H_INCLUDED */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
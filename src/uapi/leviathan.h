@@ -0,0 +1,233 @@
+/* Binary interface shared by the drivers and userspace.
+ */
+
+#ifndef LEVIATHAN_UAPI_H_INCLUDED
+#define LEVIATHAN_UAPI_H_INCLUDED
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define LEVIATHAN_TELEMETRY_VERSION    1
+#define LEVIATHAN_TELEMETRY_FRAME_SIZE 32
+
+/**
+ * A single sample of a device's status, as read from attribute `telemetry`.
+ * Fields which a device does not report are 0.  New fields are only ever
+ * appended, with `version` incremented; `size` is the size of the whole
+ * structure.
+ */
+struct leviathan_telemetry {
+	__u32 version;
+	__u32 size;
+	/* the nr of the sample, counting from 1; 0 if none received yet */
+	__u64 sequence;
+	/* CLOCK_MONOTONIC time the sample was received at, in ns */
+	__s64 timestamp_ns;
+
+	/* in RPM */
+	__u16 fan_rpm;
+	__u16 pump_rpm;
+	/* in °C */
+	__u8 temp_liquid;
+	/* the percents last applied to the device; 0 if never applied */
+	__u8 fan_percent;
+	__u8 pump_percent;
+	__u8 unknown_1;
+	__u32 unknown_2;
+	__u16 unknown_3;
+
+	/* the status message as received: the first frame_size bytes of
+	 * frame
+	 */
+	__u8 frame_size;
+	__u8 reserved;
+	__u8 frame[LEVIATHAN_TELEMETRY_FRAME_SIZE];
+} __attribute__((packed));
+
+#define LEVIATHAN_RING_VERSION 1
+
+/**
+ * The header of the telemetry history ring, at the start of the ring mapped
+ * from the device's character device.  The records follow at offset
+ * `header_size`, each `record_size` bytes long; record nr n (counting from 0)
+ * is stored in slot n % `records`.
+ *
+ * `head` and `tail` are 32-bit so that they are read whole on any
+ * architecture; they wrap around, so they are compared by the sign of their
+ * difference as a __s32, and `records` is a power of two, so that the slot of
+ * a record stays the same across the wrap.  The kernel issues a write barrier
+ * between writing a record and publishing it in `head`.
+ *
+ * The mapping is read-only, so every reader keeps its own position.  To drain
+ * the records from that position:
+ * 1. read `head`, then issue a read barrier (or read it with an acquire
+ *    load),
+ * 2. copy the records from position, or from `tail` if position is behind it,
+ *    up to `head`,
+ * 3. issue a read barrier, then read `tail` again: the records copied which are
+ *    behind it have been overwritten meanwhile, and must be discarded,
+ * 4. continue from `head` next time.
+ */
+struct leviathan_ring {
+	__u32 version;
+	__u32 header_size;
+	__u32 record_size;
+	__u32 records;
+	/* the nr of records written so far, modulo 2^32 */
+	__u32 head;
+	/* the nr of the oldest record not yet overwritten, modulo 2^32 */
+	__u32 tail;
+} __attribute__((packed));
+
+/*
+ * Generic netlink family, named after the driver ("kraken" or "kraken_x62").
+ * Devices are identified by the minor number of their character device.
+ */
+
+#define LEVIATHAN_GENL_VERSION         1
+#define LEVIATHAN_GENL_MCGRP_TELEMETRY "telemetry"
+
+enum leviathan_genl_cmd {
+	LEVIATHAN_GENL_CMD_UNSPEC,
+	/* a device's sample: multicast to group "telemetry" after each update,
+	 * and the reply to LEVIATHAN_GENL_CMD_GET
+	 */
+	LEVIATHAN_GENL_CMD_SAMPLE,
+	/* get a device's sample, or every device's when dumped */
+	LEVIATHAN_GENL_CMD_GET,
+	/* set any of a device's percents at once (CAP_NET_ADMIN only) */
+	LEVIATHAN_GENL_CMD_SET,
+	__LEVIATHAN_GENL_CMD_MAX,
+};
+#define LEVIATHAN_GENL_CMD_MAX (__LEVIATHAN_GENL_CMD_MAX - 1)
+
+enum leviathan_genl_attr {
+	LEVIATHAN_GENL_ATTR_UNSPEC,
+	/* u32 */
+	LEVIATHAN_GENL_ATTR_DEVICE,
+	/* NUL-terminated string */
+	LEVIATHAN_GENL_ATTR_SERIAL,
+	/* struct leviathan_telemetry */
+	LEVIATHAN_GENL_ATTR_TELEMETRY,
+	/* u8, in percents; LEVIATHAN_GENL_CMD_SET fails with EINVAL, setting
+	 * neither, if either is out of the range the device accepts
+	 * (30 to 100 for "kraken"; 35 to 100 for the fan and 50 to 100 for
+	 * the pump for "kraken_x62"), rather than clamping it
+	 */
+	LEVIATHAN_GENL_ATTR_FAN_PERCENT,
+	LEVIATHAN_GENL_ATTR_PUMP_PERCENT,
+	__LEVIATHAN_GENL_ATTR_MAX,
+};
+#define LEVIATHAN_GENL_ATTR_MAX (__LEVIATHAN_GENL_ATTR_MAX - 1)
+
+/*
+ * Batched control through the device's character device.  A single
+ * LEVIATHAN_IOC_BATCH sets any of the percents and LEDs at once, as if written
+ * to their attributes, and gets the device's latest sample.  Either everything
+ * requested is set, or nothing is, if any of it is invalid or unsupported by
+ * the device.  Setting anything requires the file to be open for writing.
+ */
+
+/* the bits of leviathan_batch.set */
+#define LEVIATHAN_BATCH_FAN_PERCENT  (1U << 0)
+#define LEVIATHAN_BATCH_PUMP_PERCENT (1U << 1)
+#define LEVIATHAN_BATCH_LED_LOGO     (1U << 2)
+#define LEVIATHAN_BATCH_LEDS_RING    (1U << 3)
+#define LEVIATHAN_BATCH_LEDS_SYNC    (1U << 4)
+
+#define LEVIATHAN_LED_CYCLES      8
+#define LEVIATHAN_LED_RING_COLORS 8
+
+/*
+ * The values of the LED settings are those of the device's own messages, as
+ * documented for the attributes in doc/drivers/kraken_x62.md.
+ */
+
+enum leviathan_led_preset {
+	LEVIATHAN_LED_PRESET_FIXED            = 0x00,
+	LEVIATHAN_LED_PRESET_FADING           = 0x01,
+	LEVIATHAN_LED_PRESET_SPECTRUM_WAVE    = 0x02,
+	LEVIATHAN_LED_PRESET_MARQUEE          = 0x03,
+	LEVIATHAN_LED_PRESET_COVERING_MARQUEE = 0x04,
+	LEVIATHAN_LED_PRESET_ALTERNATING      = 0x05,
+	LEVIATHAN_LED_PRESET_BREATHING        = 0x06,
+	LEVIATHAN_LED_PRESET_PULSE            = 0x07,
+	LEVIATHAN_LED_PRESET_TAI_CHI          = 0x08,
+	LEVIATHAN_LED_PRESET_WATER_COOLER     = 0x09,
+	LEVIATHAN_LED_PRESET_LOAD             = 0x0a,
+};
+
+enum leviathan_led_direction {
+	LEVIATHAN_LED_DIRECTION_FORWARD  = 0x0,
+	LEVIATHAN_LED_DIRECTION_BACKWARD = 0x1,
+};
+
+enum leviathan_led_interval {
+	LEVIATHAN_LED_INTERVAL_SLOWEST = 0x0,
+	LEVIATHAN_LED_INTERVAL_SLOWER  = 0x1,
+	LEVIATHAN_LED_INTERVAL_NORMAL  = 0x2,
+	LEVIATHAN_LED_INTERVAL_FASTER  = 0x3,
+	LEVIATHAN_LED_INTERVAL_FASTEST = 0x4,
+};
+
+struct leviathan_color {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+} __attribute__((packed));
+
+/**
+ * The colors of one cycle.  The logo only uses `logo`, the ring only `ring`,
+ * and sync both.
+ */
+struct leviathan_led_cycle {
+	struct leviathan_color logo;
+	struct leviathan_color ring[LEVIATHAN_LED_RING_COLORS];
+} __attribute__((packed));
+
+/**
+ * The settings of a group of LEDs, as written to attribute `led_logo`,
+ * `leds_ring` or `leds_sync`.  Only the first `cycles` cycles are used.
+ */
+struct leviathan_leds {
+	__u8 cycles;
+	/* enum leviathan_led_preset */
+	__u8 preset;
+	/* 0 or 1 */
+	__u8 moving;
+	/* enum leviathan_led_direction */
+	__u8 direction;
+	/* enum leviathan_led_interval */
+	__u8 interval;
+	/* 3 to 6 */
+	__u8 group_size;
+	__u8 reserved[2];
+	struct leviathan_led_cycle cycle[LEVIATHAN_LED_CYCLES];
+} __attribute__((packed));
+
+/**
+ * The argument of LEVIATHAN_IOC_BATCH.  `size` must be the size of the
+ * structure; `set` is any of the LEVIATHAN_BATCH_* bits, saying which of the
+ * settings to set, the others being ignored.  The reserved fields must be 0.
+ * On return, `telemetry` holds the device's latest sample.
+ */
+struct leviathan_batch {
+	__u32 size;
+	__u32 set;
+	/* in percents, rejected with EINVAL if out of the range the device
+	 * accepts, as LEVIATHAN_GENL_ATTR_FAN_PERCENT and _PUMP_PERCENT are
+	 */
+	__u8 fan_percent;
+	__u8 pump_percent;
+	__u8 reserved[6];
+	struct leviathan_leds led_logo;
+	struct leviathan_leds leds_ring;
+	struct leviathan_leds leds_sync;
+	struct leviathan_telemetry telemetry;
+} __attribute__((packed));
+
+#define LEVIATHAN_IOC_MAGIC 0xb4
+#define LEVIATHAN_IOC_BATCH _IOWR(LEVIATHAN_IOC_MAGIC, 0x01, \
+                                  struct leviathan_batch)
+
+#endif  /* LEVIATHAN_UAPI_H_INCLUDED */
@@ -0,0 +1,156 @@
+/* Implementation of the windowed statistics of the readings.
+ */
+
+#include "window.h"
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+static const char *const kraken_window_names[KRAKEN_WINDOW_READINGS] = {
+	[KRAKEN_WINDOW_TEMP_LIQUID] = "temp_liquid",
+	[KRAKEN_WINDOW_FAN_RPM]     = "fan_rpm",
+	[KRAKEN_WINDOW_PUMP_RPM]    = "pump_rpm",
+};
+
+void kraken_windows_init(struct kraken_windows *windows,
+                         const unsigned int *lengths_s, unsigned int nr)
+{
+	unsigned int i;
+	memset(windows, 0, sizeof(*windows));
+	spin_lock_init(&windows->lock);
+	windows->nr = min_t(unsigned int, nr, KRAKEN_WINDOWS_MAX);
+	for (i = 0; i < windows->nr; i++) {
+		const unsigned int length_s
+			= clamp_t(unsigned int, lengths_s[i], 1,
+			          KRAKEN_WINDOW_LENGTH_MAX_S);
+		windows->windows[i].length = ktime_set(length_s, 0);
+	}
+}
+
+static void kraken_window_aggregate(struct kraken_window_aggregate *aggregate,
+                                    u16 value)
+{
+	const s64 value_milli = (s64) value * 1000;
+	s64 delta;
+
+	if (aggregate->samples == 0) {
+		aggregate->min = value;
+		aggregate->max = value;
+	} else {
+		aggregate->min = min(aggregate->min, value);
+		aggregate->max = max(aggregate->max, value);
+	}
+	aggregate->samples++;
+	// Welford's update: no sums which could overflow, and no cancellation
+	delta = value_milli - aggregate->mean_milli;
+	aggregate->mean_milli += div_s64(delta, aggregate->samples);
+	// never negative but for the rounding of the mean
+	aggregate->m2_milli += max_t(s64, div_s64(delta * (value_milli -
+		aggregate->mean_milli), 1000), 0);
+}
+
+void kraken_windows_push(struct kraken_windows *windows,
+                         const struct leviathan_telemetry *telemetry)
+{
+	const ktime_t now = ns_to_ktime(telemetry->timestamp_ns);
+	const u16 values[KRAKEN_WINDOW_READINGS] = {
+		[KRAKEN_WINDOW_TEMP_LIQUID] = telemetry->temp_liquid,
+		[KRAKEN_WINDOW_FAN_RPM]     = telemetry->fan_rpm,
+		[KRAKEN_WINDOW_PUMP_RPM]    = telemetry->pump_rpm,
+	};
+	unsigned long flags;
+	unsigned int i, j;
+
+	spin_lock_irqsave(&windows->lock, flags);
+	for (i = 0; i < windows->nr; i++) {
+		struct kraken_window *window = &windows->windows[i];
+		const s64 length_ms = ktime_to_ms(window->length);
+		const ktime_t end = ktime_add(window->start, window->length);
+		s64 elapsed_ms;
+
+		if (ktime_to_ns(window->start) == 0) {
+			window->start = now;
+		} else if (ktime_compare(now, end) >= 0) {
+			// past the end: close the window, or if a whole window
+			// has passed without samples, the last one closed is
+			// empty
+			if (ktime_compare(now, ktime_add(end, window->length))
+			    >= 0) {
+				memset(window->last, 0, sizeof(window->last));
+				window->start = now;
+			} else {
+				memcpy(window->last, window->running,
+				       sizeof(window->last));
+				window->start = end;
+			}
+			memset(window->running, 0, sizeof(window->running));
+		}
+
+		// the weight of the new sample is the time since the previous
+		// one relative to the window's length.  The EWMA is kept in
+		// millionths and rounded, so that small weights still move it
+		// all the way to the value; in ms, the product fits an s64
+		// even at the longest window and highest RPM
+		elapsed_ms = ktime_to_ns(windows->prev) == 0 ? length_ms
+			: ktime_ms_delta(now, windows->prev);
+		elapsed_ms = clamp_t(s64, elapsed_ms, 0, length_ms);
+		for (j = 0; j < KRAKEN_WINDOW_READINGS; j++) {
+			const s64 value_micro = (s64) values[j] * 1000000;
+			s64 *ewma = &window->ewma_micro[j];
+			kraken_window_aggregate(&window->running[j], values[j]);
+			*ewma += DIV_S64_ROUND_CLOSEST(
+				(value_micro - *ewma) * elapsed_ms,
+				(s32) length_ms);
+		}
+	}
+	windows->prev = now;
+	spin_unlock_irqrestore(&windows->lock, flags);
+}
+
+/* Print a value in thousandths as a decimal.
+ */
+static int kraken_windows_show_milli(char *buf, size_t size, s64 milli)
+{
+	u32 rem;
+	const u64 whole = div_u64_rem(max_t(s64, milli, 0), 1000, &rem);
+	return scnprintf(buf, size, " %llu.%03u", whole, rem);
+}
+
+ssize_t kraken_windows_show(struct kraken_windows *windows, char *buf)
+{
+	struct kraken_window copy[KRAKEN_WINDOWS_MAX];
+	unsigned long flags;
+	ssize_t len = 0;
+	unsigned int i, j;
+
+	spin_lock_irqsave(&windows->lock, flags);
+	memcpy(copy, windows->windows, sizeof(copy));
+	spin_unlock_irqrestore(&windows->lock, flags);
+
+	for (i = 0; i < windows->nr; i++) {
+		const struct kraken_window *window = &copy[i];
+		const s64 length_s = ktime_divns(window->length, NSEC_PER_SEC);
+		for (j = 0; j < KRAKEN_WINDOW_READINGS; j++) {
+			const struct kraken_window_aggregate *last
+				= &window->last[j];
+			const u64 variance_milli = last->samples == 0 ? 0
+				: div_u64(last->m2_milli, last->samples);
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+			                 "%lld %s %u %u %u", length_s,
+			                 kraken_window_names[j], last->samples,
+			                 last->min, last->max);
+			len += kraken_windows_show_milli(
+				buf + len, PAGE_SIZE - len, last->mean_milli);
+			len += kraken_windows_show_milli(
+				buf + len, PAGE_SIZE - len, variance_milli);
+			len += kraken_windows_show_milli(
+				buf + len, PAGE_SIZE - len,
+				DIV_S64_ROUND_CLOSEST(window->ewma_micro[j],
+				                      1000));
+			len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+		}
+	}
+	return len;
+}
@@ -0,0 +1,81 @@
+/* Statistics of the readings over windows of time, maintained incrementally as
+ * samples are received.
+ */
+
+#ifndef LEVIATHAN_WINDOW_H_INCLUDED
+#define LEVIATHAN_WINDOW_H_INCLUDED
+
+#include "uapi/leviathan.h"
+
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#define KRAKEN_WINDOWS_MAX         4
+#define KRAKEN_WINDOW_LENGTH_MAX_S 86400
+
+/**
+ * The readings kept statistics of.
+ */
+enum kraken_window_reading {
+	KRAKEN_WINDOW_TEMP_LIQUID,
+	KRAKEN_WINDOW_FAN_RPM,
+	KRAKEN_WINDOW_PUMP_RPM,
+	KRAKEN_WINDOW_READINGS,
+};
+
+/**
+ * Aggregates of a reading's samples within a window.  The mean and the sum of
+ * squared deviations from it are kept in thousandths, by Welford's method.
+ */
+struct kraken_window_aggregate {
+	u32 samples;
+	u16 min;
+	u16 max;
+	s64 mean_milli;
+	u64 m2_milli;
+};
+
+/**
+ * A tumbling window: the aggregates of the window in progress, and of the last
+ * one closed, which are what's shown.  The EWMA runs on across windows, with
+ * the window's length as its time constant.
+ */
+struct kraken_window {
+	ktime_t length;
+	ktime_t start;
+	struct kraken_window_aggregate running[KRAKEN_WINDOW_READINGS];
+	struct kraken_window_aggregate last[KRAKEN_WINDOW_READINGS];
+	s64 ewma_micro[KRAKEN_WINDOW_READINGS];
+};
+
+struct kraken_windows {
+	// the samples are pushed from URB completion handlers
+	spinlock_t lock;
+	unsigned int nr;
+	// when the previous sample was received, or 0 if none
+	ktime_t prev;
+	struct kraken_window windows[KRAKEN_WINDOWS_MAX];
+};
+
+/**
+ * Initialize the windows with the given lengths in s, each clamped to
+ * [1, KRAKEN_WINDOW_LENGTH_MAX_S].
+ */
+void kraken_windows_init(struct kraken_windows *windows,
+                         const unsigned int *lengths_s, unsigned int nr);
+
+/**
+ * Add a sample to every window, closing those it falls past the end of.  O(1)
+ * per window.  Safe to call from URB completion handlers.
+ */
+void kraken_windows_push(struct kraken_windows *windows,
+                         const struct leviathan_telemetry *telemetry);
+
+/**
+ * Print the statistics of every window, one line per window and reading, as
+ * read from attribute `readings_stats`.
+ */
+ssize_t kraken_windows_show(struct kraken_windows *windows, char *buf);
+
+#endif  /* LEVIATHAN_WINDOW_H_INCLUDED */